@@ -0,0 +1,72 @@
+#include <errno.h>
+#include <lz4.h>
+#include <string.h>
+#include <zstd.h>
+
+#include "compress.h"
+#include "format.h"
+
+// The zstd compression level. Frames must be compressed faster than vCPUs produce them
+#define COMPRESS_ZSTD_LEVEL	1
+
+int compressor_init(struct compressor *comp, enum compress_algo algo)
+{
+	comp->algo = algo;
+	comp->zstd = NULL;
+	if (algo == COMPRESS_ZSTD)
+	{
+		comp->zstd = ZSTD_createCCtx();
+		if (!comp->zstd)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+size_t compress_bound(const struct compressor *comp, size_t len)
+{
+	size_t bound = comp->algo == COMPRESS_ZSTD ? ZSTD_compressBound(len) : LZ4_compressBound(len);
+	return BLOCK_HEADER_MAX_SIZE + bound;
+}
+
+uint8_t *compress_frame(struct compressor *comp, uint8_t *buf, const uint8_t *src, size_t len,
+		size_t *block_len)
+{
+	// The payload is compressed first, then the header is written right before it
+	uint8_t *payload = buf + BLOCK_HEADER_MAX_SIZE;
+	size_t capacity = compress_bound(comp, len) - BLOCK_HEADER_MAX_SIZE;
+	size_t payload_len;
+	uint8_t tag;
+	if (comp->algo == COMPRESS_ZSTD)
+	{
+		payload_len = ZSTD_compressCCtx(comp->zstd, payload, capacity, src, len,
+				COMPRESS_ZSTD_LEVEL);
+		if (ZSTD_isError(payload_len))
+			return NULL;
+		tag = BLOCK_ZSTD;
+	}
+	else
+	{
+		int ret = LZ4_compress_default((const char *) src, (char *) payload, len, capacity);
+		if (ret <= 0)
+			return NULL;
+		payload_len = ret;
+		tag = BLOCK_LZ4;
+	}
+	uint8_t hdr[BLOCK_HEADER_MAX_SIZE];
+	size_t hdr_len = 0;
+	hdr[hdr_len++] = tag;
+	hdr_len += varint_put(hdr + hdr_len, len);
+	hdr_len += varint_put(hdr + hdr_len, payload_len);
+	uint8_t *start = payload - hdr_len;
+	memcpy(start, hdr, hdr_len);
+	*block_len = hdr_len + payload_len;
+	return start;
+}
+
+void compressor_fini(struct compressor *comp)
+{
+	ZSTD_freeCCtx(comp->zstd);
+}
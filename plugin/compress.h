@@ -0,0 +1,43 @@
+// Compression of the output file
+//
+// The writer thread gathers the blocks of vCPUs into frames, and compresses each frame on its own
+// (see `BLOCK_ZSTD` and `BLOCK_LZ4`), so that the aggregator can decompress them in parallel.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The compression algorithm of the output file
+enum compress_algo
+{
+	COMPRESS_NONE,
+	COMPRESS_ZSTD,
+	COMPRESS_LZ4,
+};
+
+struct compressor
+{
+	enum compress_algo algo;
+	// The zstd context, reused across frames
+	void *zstd;
+};
+
+// Initializes a compressor using the given algorithm.
+//
+// On error, the function returns `-1` and sets `errno`.
+int compressor_init(struct compressor *comp, enum compress_algo algo);
+// Returns the size of the buffer required by `compress_frame` for a frame of `len` bytes.
+size_t compress_bound(const struct compressor *comp, size_t len);
+// Compresses the frame `src` of `len` bytes into the block `buf`, which must be at least
+// `compress_bound(comp, len)` bytes long. The function returns the start of the block and stores
+// its total size in `block_len`.
+//
+// On error, the function returns `NULL`.
+uint8_t *compress_frame(struct compressor *comp, uint8_t *buf, const uint8_t *src, size_t len,
+		size_t *block_len);
+// Frees the resources of the compressor.
+void compressor_fini(struct compressor *comp);
+
+#endif
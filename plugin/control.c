@@ -0,0 +1,75 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "control.h"
+
+struct control
+{
+	// The path of the FIFO
+	const char *path;
+	// The state commands are applied to
+	atomic_bool *armed;
+	// The thread reading commands
+	pthread_t thread;
+};
+
+static struct control control;
+
+static void *control_main(void *arg)
+{
+	char *line = NULL;
+	size_t size = 0;
+	while (true)
+	{
+		// Opening blocks until a writer opens the FIFO, and reading stops once all writers have
+		// closed it, so the FIFO is opened again for each batch of commands
+		FILE *file = fopen(control.path, "r");
+		if (!file)
+		{
+			if (errno == EINTR)
+				continue;
+			dprintf(STDERR_FILENO, "warning: %s: %s, sampling can no longer be controlled\n", control.path, strerror(errno));
+			break;
+		}
+		ssize_t len;
+		while ((len = getline(&line, &size, file)) >= 0)
+		{
+			if (len > 0 && line[len - 1] == '\n')
+				line[len - 1] = '\0';
+			if (!strcmp(line, "start"))
+				atomic_store(control.armed, true);
+			else if (!strcmp(line, "stop"))
+				atomic_store(control.armed, false);
+			else if (line[0])
+				dprintf(STDERR_FILENO, "warning: %s: unknown command `%s`\n", control.path, line);
+		}
+		fclose(file);
+	}
+	free(line);
+	return NULL;
+}
+
+int control_init(const char *path, atomic_bool *armed)
+{
+	if (mkfifo(path, 0666) < 0 && errno != EEXIST)
+		return -1;
+	control.path = path;
+	control.armed = armed;
+	// The thread is blocked on the FIFO most of the time, so it is not joined at exit
+	int err = pthread_create(&control.thread, NULL, control_main, NULL);
+	if (!err)
+		err = pthread_detach(control.thread);
+	if (err)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,17 @@
+// Control of sampling from outside of QEMU
+//
+// A background thread reads commands from a FIFO, one per line: `start` arms sampling and `stop`
+// disarms it. For example: `echo start > <path>`.
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdatomic.h>
+
+// Creates the FIFO `path` if it does not exist, and starts the thread reading commands from it.
+// Commands are applied to `armed`.
+//
+// On error, the function returns `-1` and sets `errno`.
+int control_init(const char *path, atomic_bool *armed);
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "fold.h"
+
+// The initial number of entries of a table
+#define FOLD_INIT_CAPACITY	1024
+
+int fold_table_init(struct fold_table *table)
+{
+	table->entries = calloc(FOLD_INIT_CAPACITY, sizeof(struct fold_entry));
+	table->capacity = FOLD_INIT_CAPACITY;
+	table->count = 0;
+	table->frames = NULL;
+	table->frames_len = 0;
+	table->frames_capacity = 0;
+	return table->entries ? 0 : -1;
+}
+
+void fold_table_fini(struct fold_table *table)
+{
+	free(table->entries);
+	free(table->frames);
+}
+
+static uint64_t hash_stack(const uint64_t *frames, uint8_t depth)
+{
+	uint64_t hash = depth;
+	for (uint8_t i = 0; i < depth; i++)
+	{
+		hash = (hash ^ frames[i]) * 0x9e3779b97f4a7c15;
+		hash ^= hash >> 32;
+	}
+	return hash;
+}
+
+// Returns the entry for the given stack, or the free entry where it must be inserted.
+static struct fold_entry *fold_table_find(struct fold_table *table, uint64_t hash,
+		const uint64_t *frames, uint8_t depth)
+{
+	size_t mask = table->capacity - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask)
+	{
+		struct fold_entry *ent = &table->entries[i];
+		if (!ent->count)
+			return ent;
+		if (ent->hash == hash && ent->depth == depth
+				&& !memcmp(&table->frames[ent->off], frames, depth * sizeof(uint64_t)))
+			return ent;
+	}
+}
+
+// Doubles the number of entries of the table.
+static bool fold_table_grow(struct fold_table *table)
+{
+	struct fold_entry *old = table->entries;
+	size_t old_capacity = table->capacity;
+	table->entries = calloc(old_capacity * 2, sizeof(struct fold_entry));
+	if (!table->entries)
+	{
+		table->entries = old;
+		return false;
+	}
+	table->capacity = old_capacity * 2;
+	for (size_t i = 0; i < old_capacity; i++)
+	{
+		if (!old[i].count)
+			continue;
+		size_t mask = table->capacity - 1;
+		size_t j = old[i].hash & mask;
+		while (table->entries[j].count)
+			j = (j + 1) & mask;
+		table->entries[j] = old[i];
+	}
+	free(old);
+	return true;
+}
+
+bool fold_table_add(struct fold_table *table, const uint64_t *frames, uint8_t depth)
+{
+	uint64_t hash = hash_stack(frames, depth);
+	struct fold_entry *ent = fold_table_find(table, hash, frames, depth);
+	if (ent->count)
+	{
+		ent->count++;
+		return true;
+	}
+	// Insert new stack. Keep the load factor under 1/2
+	if ((table->count + 1) * 2 > table->capacity)
+	{
+		if (!fold_table_grow(table))
+			return false;
+		ent = fold_table_find(table, hash, frames, depth);
+	}
+	if (table->frames_len + depth > table->frames_capacity)
+	{
+		size_t capacity = table->frames_capacity ? table->frames_capacity * 2 : 8192;
+		while (capacity < table->frames_len + depth)
+			capacity *= 2;
+		uint64_t *new_frames = realloc(table->frames, capacity * sizeof(uint64_t));
+		if (!new_frames)
+			return false;
+		table->frames = new_frames;
+		table->frames_capacity = capacity;
+	}
+	memcpy(&table->frames[table->frames_len], frames, depth * sizeof(uint64_t));
+	ent->hash = hash;
+	ent->count = 1;
+	ent->off = table->frames_len;
+	ent->depth = depth;
+	table->frames_len += depth;
+	table->count++;
+	return true;
+}
@@ -0,0 +1,56 @@
+// Table of folded stacks
+//
+// When aggregating in the plugin, each vCPU counts identical stacks in its own table instead of
+// writing every sample to the output file.
+
+#ifndef FOLD_H
+#define FOLD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// An entry of the table
+struct fold_entry
+{
+	// The hash of the stack
+	uint64_t hash;
+	// The number of occurrences of the stack. If zero, the entry is free
+	uint64_t count;
+	// The offset of the stack's frames in the table's `frames` array
+	size_t off;
+	// The number of frames of the stack
+	uint8_t depth;
+};
+
+// Open-addressing hash table associating stacks with their number of occurrences
+struct fold_table
+{
+	// The entries. The number of elements is a power of two
+	struct fold_entry *entries;
+	// The number of elements in `entries`
+	size_t capacity;
+	// The number of used entries
+	size_t count;
+
+	// The frames of all stacks in the table, stored contiguously
+	uint64_t *frames;
+	// The number of elements used in `frames`
+	size_t frames_len;
+	// The number of elements allocated in `frames`
+	size_t frames_capacity;
+};
+
+// Initializes an empty table.
+//
+// On error, the function returns `-1` and sets `errno`.
+int fold_table_init(struct fold_table *table);
+// Frees the table.
+void fold_table_fini(struct fold_table *table);
+
+// Increments the number of occurrences of the stack `frames` of `depth` frames.
+//
+// If memory cannot be allocated to insert the stack, the function returns `false`.
+bool fold_table_add(struct fold_table *table, const uint64_t *frames, uint8_t depth);
+
+#endif
@@ -0,0 +1,42 @@
+#include "format.h"
+
+size_t format_put_header(uint8_t *buf, const struct format_header *hdr)
+{
+	uint16_t version = FORMAT_VERSION;
+	uint16_t len = 32 + hdr->build_id_len;
+	memcpy(&buf[0], FORMAT_MAGIC, 4);
+	memcpy(&buf[4], &version, sizeof(version));
+	// Allows readers to skip fields they do not know about
+	memcpy(&buf[6], &len, sizeof(len));
+	buf[8] = hdr->ptr_width;
+	buf[9] = hdr->flags;
+	buf[10] = hdr->sample_mode;
+	buf[11] = hdr->build_id_len;
+	memcpy(&buf[12], &hdr->vcpus, sizeof(hdr->vcpus));
+	memcpy(&buf[16], &hdr->sample_interval, sizeof(hdr->sample_interval));
+	memcpy(&buf[24], &hdr->base, sizeof(hdr->base));
+	memcpy(&buf[32], hdr->build_id, hdr->build_id_len);
+	return len;
+}
+
+size_t format_put_stats(uint8_t *buf, unsigned int cpu_index, const struct format_stats *stats)
+{
+	uint64_t counters[] = {
+		stats->samples,
+		stats->drops,
+		stats->max_depth,
+		stats->read_errors,
+		stats->bytes,
+		stats->sample_ns,
+	};
+	uint8_t payload[sizeof(counters) / sizeof(counters[0]) * VARINT_MAX_SIZE];
+	size_t payload_len = 0;
+	for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++)
+		payload_len += varint_put(payload + payload_len, counters[i]);
+	size_t len = 0;
+	buf[len++] = BLOCK_STATS;
+	len += varint_put(buf + len, cpu_index);
+	len += varint_put(buf + len, payload_len);
+	memcpy(buf + len, payload, payload_len);
+	return len + payload_len;
+}
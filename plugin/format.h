@@ -0,0 +1,238 @@
+// Format of the output file
+//
+// The file begins with a header (see `format_put_header`). Then come blocks, each containing
+// records collected on a single vCPU:
+// - tag (`u8`): `BLOCK_SAMPLES`
+// - the vCPU ID (varint)
+// - the size of the payload in bytes (varint)
+// - the payload: records
+//
+// Each record is a stack:
+// - if the header has the flag `FORMAT_FLAG_TIMESTAMPS`: the timestamp of the sample (varint),
+// relative to the previous record of the block. The first record of a block is relative to zero,
+// so that blocks can be decoded independently
+// - if the header has the flag `FORMAT_FLAG_ADDRESS_SPACES`: the tag of the address space the
+// sample has been collected in (zigzag varint), relative to the previous record of the block like
+// timestamps
+// - if the header has the flag `FORMAT_FLAG_CONTEXTS`: the contexts of the stack (varint). Bit `i`
+// is set if frame `i` is the instruction where an interrupt or exception was taken: the frames
+// below belong to its handler, the ones from `i` to the interrupted code
+// - the depth of the stack (varint)
+// - if the header has the flag `FORMAT_FLAG_AGGREGATED`: the number of occurrences (varint)
+// - the frames: the first frame is encoded relative to the base address of the header, then each
+// frame relative to the previous one, as zigzag varints
+//
+// If the header has the flag `FORMAT_FLAG_STATS`, the file ends with one `BLOCK_STATS` block per
+// vCPU, with the same header as other blocks. Its payload is made of the counters of
+// `struct format_stats`, as varints in the order of the structure. Counters added later are
+// appended, so readers must ignore the ones they do not know about.
+//
+// With the plugin argument `compress`, blocks are gathered into frames, each compressed on its own
+// and written as a block with the tag `BLOCK_ZSTD` or `BLOCK_LZ4`. Its header holds the size of
+// the decompressed payload instead of a vCPU ID. The decompressed payload is made of whole blocks.
+// Counters are never compressed.
+//
+// Varints are unsigned LEB128. All values are little-endian.
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// The magic number at the beginning of the file. The first byte is greater than any tag of the
+// legacy format, so that the aggregator can tell both apart
+#define FORMAT_MAGIC			"\x7f" "KPF"
+// The current version of the format
+#define FORMAT_VERSION			1
+// The maximum length of the build ID in the header
+#define FORMAT_BUILD_ID_MAX		64
+
+// Header flag: records contain the number of occurrences of the stack
+#define FORMAT_FLAG_AGGREGATED	(1 << 0)
+// Header flag: records contain a timestamp, whose unit depends on the sampling mode. In time
+// mode, this is the amount of nanoseconds since the plugin has been loaded. In instructions mode,
+// this is the number of instructions executed by the vCPU. In memory accesses mode, this is the
+// number of memory accesses made by the vCPU
+#define FORMAT_FLAG_TIMESTAMPS	(1 << 1)
+// Header flag: records contain the tag of their address space, which is the value of CR3 without
+// its flags (the physical address of the top-level page table)
+#define FORMAT_FLAG_ADDRESS_SPACES	(1 << 2)
+// Header flag: the file ends with the counters of the plugin (see `struct format_stats`)
+#define FORMAT_FLAG_STATS		(1 << 3)
+// Header flag: records contain the boundaries between interrupt or exception handlers and the code
+// they interrupted. Frames that cannot be resolved are then left as is, instead of splitting the
+// stack
+#define FORMAT_FLAG_CONTEXTS	(1 << 4)
+
+// Sampling mode: a sample is collected every `sample_interval` nanoseconds
+#define SAMPLE_MODE_TIME		0
+// Sampling mode: a sample is collected every `sample_interval` instructions
+#define SAMPLE_MODE_INSNS		1
+// Sampling mode: a sample is collected every `sample_interval` memory accesses, attributed to the
+// instruction making the access
+#define SAMPLE_MODE_ACCESSES	2
+
+// Tag of a block of stack samples
+#define BLOCK_SAMPLES			1
+// Tag of a block of counters of a vCPU
+#define BLOCK_STATS				2
+// Tag of a block of blocks compressed as a zstd frame
+#define BLOCK_ZSTD				3
+// Tag of a block of blocks compressed in the LZ4 block format
+#define BLOCK_LZ4				4
+
+// The maximum size of a varint in bytes
+#define VARINT_MAX_SIZE			10
+// The maximum size of the header of a block in bytes
+#define BLOCK_HEADER_MAX_SIZE	(1 + 2 * VARINT_MAX_SIZE)
+// The size of the payload of a block after which it is written
+#define BLOCK_SIZE				(16 * 1024)
+// The maximum size of a block of counters in bytes
+#define STATS_MAX_SIZE			(BLOCK_HEADER_MAX_SIZE + 6 * VARINT_MAX_SIZE)
+
+struct format_header
+{
+	// sizeof(target_ulong)
+	uint8_t ptr_width;
+	// Flags (see `FORMAT_FLAG_*`)
+	uint8_t flags;
+	// The sampling mode (see `SAMPLE_MODE_*`)
+	uint8_t sample_mode;
+	// The length of `build_id` in bytes. If zero, the kernel build is unknown
+	uint8_t build_id_len;
+	// The number of vCPUs
+	uint32_t vcpus;
+	// The interval between samples, whose unit depends on `sample_mode`
+	uint64_t sample_interval;
+	// The base address frames are encoded relatively to
+	uint64_t base;
+	// The build ID of the observed kernel
+	uint8_t build_id[FORMAT_BUILD_ID_MAX];
+};
+
+// Counters of the plugin for a vCPU, to tell how much a profile can be trusted
+struct format_stats
+{
+	// The number of samples collected, including dropped ones
+	uint64_t samples;
+	// The number of samples lost, because the ring buffer was full, because the output file could
+	// not grow or because the folded stacks table could not grow
+	uint64_t drops;
+	// The number of stacks truncated at the maximum depth
+	uint64_t max_depth;
+	// The number of stacks whose unwinding stopped because the stack could not be read (unmapped
+	// memory, or beyond the copied window)
+	uint64_t read_errors;
+	// The number of bytes handed to the output, before compression
+	uint64_t bytes;
+	// The time spent collecting samples in nanoseconds
+	uint64_t sample_ns;
+};
+
+// A block being filled by a vCPU
+struct block
+{
+	// The size of the payload in bytes
+	size_t len;
+	// The number of records in the payload
+	size_t records;
+	// The timestamp of the last record in the payload
+	uint64_t last_ts;
+	// The address space tag of the last record in the payload
+	uint64_t last_asid;
+	// Room for the header, followed by the payload
+	uint8_t buf[BLOCK_HEADER_MAX_SIZE + BLOCK_SIZE];
+};
+
+// Encodes `val` as a varint in `buf`. The function returns the number of bytes written.
+static inline size_t varint_put(uint8_t *buf, uint64_t val)
+{
+	size_t i = 0;
+	while (val >= 0x80)
+	{
+		buf[i++] = val | 0x80;
+		val >>= 7;
+	}
+	buf[i++] = val;
+	return i;
+}
+
+// Encodes the signed value `val` so that values close to zero have a short varint encoding.
+static inline uint64_t zigzag(int64_t val)
+{
+	return ((uint64_t) val << 1) ^ (uint64_t) (val >> 63);
+}
+
+// Encodes a stack of `depth` frames in `buf`. If `count` is non-zero, it is written as the
+// number of occurrences. The function returns the number of bytes written.
+static inline size_t format_put_stack(uint8_t *buf, uint64_t base, const uint64_t *frames,
+		uint8_t depth, uint64_t count)
+{
+	size_t len = varint_put(buf, depth);
+	if (count)
+		len += varint_put(buf + len, count);
+	uint64_t prev = base;
+	for (uint8_t i = 0; i < depth; i++)
+	{
+		len += varint_put(buf + len, zigzag((int64_t) (frames[i] - prev)));
+		prev = frames[i];
+	}
+	return len;
+}
+
+// Returns a pointer to the end of the payload of the block, where the next record is written.
+static inline uint8_t *block_tail(struct block *block)
+{
+	return block->buf + BLOCK_HEADER_MAX_SIZE + block->len;
+}
+
+// Writes the header of the block right before its payload. The function returns the start of
+// the block and stores its total size in `len`.
+static inline uint8_t *block_finish(struct block *block, unsigned int cpu_index, size_t *len)
+{
+	uint8_t hdr[BLOCK_HEADER_MAX_SIZE];
+	size_t hdr_len = 0;
+	hdr[hdr_len++] = BLOCK_SAMPLES;
+	hdr_len += varint_put(hdr + hdr_len, cpu_index);
+	hdr_len += varint_put(hdr + hdr_len, block->len);
+	uint8_t *start = block->buf + BLOCK_HEADER_MAX_SIZE - hdr_len;
+	memcpy(start, hdr, hdr_len);
+	*len = hdr_len + block->len;
+	return start;
+}
+
+// Empties the block.
+static inline void block_reset(struct block *block)
+{
+	block->len = 0;
+	block->records = 0;
+	block->last_ts = 0;
+	block->last_asid = 0;
+}
+
+// Returns the tag of the address space identified by the value of CR3 (see
+// `FORMAT_FLAG_ADDRESS_SPACES`).
+static inline uint64_t format_asid(uint64_t cr3)
+{
+	return cr3 & ~(uint64_t) 0xfff;
+}
+
+// Encodes the address space tag `asid` in `buf`, relative to the previous record of the block.
+// The function returns the number of bytes written.
+static inline size_t block_put_asid(struct block *block, uint8_t *buf, uint64_t asid)
+{
+	size_t len = varint_put(buf, zigzag((int64_t) (asid - block->last_asid)));
+	block->last_asid = asid;
+	return len;
+}
+
+// Encodes the file header in `buf`, which must be at least `32 + FORMAT_BUILD_ID_MAX` bytes
+// long. The function returns the number of bytes written.
+size_t format_put_header(uint8_t *buf, const struct format_header *hdr);
+// Encodes the block of counters of the given vCPU in `buf`, which must be at least
+// `STATS_MAX_SIZE` bytes long. The function returns the number of bytes written.
+size_t format_put_stats(uint8_t *buf, unsigned int cpu_index, const struct format_stats *stats);
+
+#endif
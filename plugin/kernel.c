@@ -0,0 +1,91 @@
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kernel.h"
+
+// Looks for the GNU build ID in the notes in `buf`.
+static void read_notes(const uint8_t *buf, size_t len, struct kernel_info *info)
+{
+	size_t off = 0;
+	while (off + sizeof(Elf64_Nhdr) <= len)
+	{
+		// The layout of note headers is the same for 32 and 64 bits
+		Elf64_Nhdr nhdr;
+		memcpy(&nhdr, buf + off, sizeof(nhdr));
+		off += sizeof(nhdr);
+		size_t name_off = off;
+		off += (nhdr.n_namesz + 3) & ~3;
+		size_t desc_off = off;
+		off += (nhdr.n_descsz + 3) & ~3;
+		if (off > len)
+			break;
+		if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4
+				&& !memcmp(buf + name_off, "GNU", 4) && nhdr.n_descsz <= FORMAT_BUILD_ID_MAX)
+		{
+			memcpy(info->build_id, buf + desc_off, nhdr.n_descsz);
+			info->build_id_len = nhdr.n_descsz;
+			return;
+		}
+	}
+}
+
+// Defines the function reading program headers for the given ELF class
+#define DEFINE_READ_PHDRS(bits)\
+static int read_phdrs##bits(const uint8_t *buf, size_t len, struct kernel_info *info)\
+{\
+	const Elf##bits##_Ehdr *ehdr = (const void *) buf;\
+	if (len < sizeof(*ehdr) || ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf##bits##_Phdr) > len)\
+		return -1;\
+	uint64_t text_size = 0;\
+	for (size_t i = 0; i < ehdr->e_phnum; i++)\
+	{\
+		Elf##bits##_Phdr phdr;\
+		memcpy(&phdr, buf + ehdr->e_phoff + i * sizeof(phdr), sizeof(phdr));\
+		if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X) && phdr.p_memsz > text_size)\
+		{\
+			info->base = phdr.p_vaddr;\
+			text_size = phdr.p_memsz;\
+		}\
+		else if (phdr.p_type == PT_NOTE && phdr.p_offset + phdr.p_filesz <= len\
+				&& !info->build_id_len)\
+			read_notes(buf + phdr.p_offset, phdr.p_filesz, info);\
+	}\
+	return 0;\
+}
+
+DEFINE_READ_PHDRS(32)
+DEFINE_READ_PHDRS(64)
+
+int kernel_read_info(const char *path, struct kernel_info *info)
+{
+	memset(info, 0, sizeof(*info));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	const uint8_t *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return -1;
+	int res = -1;
+	errno = ENOEXEC;
+	if (st.st_size >= EI_NIDENT && !memcmp(buf, ELFMAG, SELFMAG))
+	{
+		if (buf[EI_CLASS] == ELFCLASS32)
+			res = read_phdrs32(buf, st.st_size, info);
+		else if (buf[EI_CLASS] == ELFCLASS64)
+			res = read_phdrs64(buf, st.st_size, info);
+	}
+	munmap((void *) buf, st.st_size);
+	return res;
+}
@@ -0,0 +1,26 @@
+// Reading of information about the observed kernel from its ELF file
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "format.h"
+
+struct kernel_info
+{
+	// The virtual address of the largest executable segment, which is where most frames are
+	uint64_t base;
+	// The GNU build ID
+	uint8_t build_id[FORMAT_BUILD_ID_MAX];
+	// The length of `build_id` in bytes. If zero, the ELF has no build ID
+	size_t build_id_len;
+};
+
+// Reads information about the ELF file at `path`.
+//
+// On error, the function returns `-1` and sets `errno`.
+int kernel_read_info(const char *path, struct kernel_info *info);
+
+#endif
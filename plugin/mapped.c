@@ -0,0 +1,108 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mapped.h"
+
+// The size of the mapping, which is the maximum size of the output file. Only address space is
+// reserved, file pages are allocated as they get used
+#define MAPPED_WINDOW	(64ull << 30)
+// The amount of bytes by which the file grows at once
+#define MAPPED_EXTENT	(64ull << 20)
+
+struct mapped
+{
+	// The FD of the output file
+	int fd;
+	// The mapping of the file
+	uint8_t *map;
+
+	// The offset of the next reservation
+	_Atomic uint64_t used;
+	// The size of the file. Reservations below this offset can be written without locking
+	_Atomic uint64_t allocated;
+
+	// Serializes the growth of the file
+	pthread_mutex_t lock;
+	// Tells whether the file failed to grow. Once set, no further growth is attempted
+	bool failed;
+	// The offset of the first reservation that could not be written. The file is truncated there
+	// at exit, so that it does not end with a hole
+	uint64_t end;
+};
+
+static struct mapped mapped = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.end = UINT64_MAX,
+};
+
+// Makes sure the file is large enough for the reservation from `off` to `end`. If it cannot grow,
+// the function returns `false`.
+static bool mapped_grow(uint64_t off, uint64_t end)
+{
+	pthread_mutex_lock(&mapped.lock);
+	uint64_t allocated = atomic_load_explicit(&mapped.allocated, memory_order_relaxed);
+	while (allocated < end && !mapped.failed)
+	{
+		int err = allocated + MAPPED_EXTENT <= MAPPED_WINDOW
+			? posix_fallocate(mapped.fd, allocated, MAPPED_EXTENT)
+			: EFBIG;
+		if (err)
+		{
+			dprintf(STDERR_FILENO, "warning: could not grow output file: %s\n", strerror(err));
+			mapped.failed = true;
+			break;
+		}
+		allocated += MAPPED_EXTENT;
+	}
+	atomic_store_explicit(&mapped.allocated, allocated, memory_order_release);
+	bool ok = allocated >= end;
+	if (!ok && off < mapped.end)
+		mapped.end = off;
+	pthread_mutex_unlock(&mapped.lock);
+	return ok;
+}
+
+int mapped_init(int fd, uint64_t off)
+{
+	mapped.fd = fd;
+	mapped.map = mmap(NULL, MAPPED_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd,
+			0);
+	if (mapped.map == MAP_FAILED)
+		return -1;
+	int err = posix_fallocate(fd, off, MAPPED_EXTENT);
+	if (err)
+	{
+		munmap(mapped.map, MAPPED_WINDOW);
+		errno = err;
+		return -1;
+	}
+	atomic_store(&mapped.used, off);
+	atomic_store(&mapped.allocated, off + MAPPED_EXTENT);
+	return 0;
+}
+
+bool mapped_write(const void *buf, size_t len)
+{
+	uint64_t off = atomic_fetch_add_explicit(&mapped.used, len, memory_order_relaxed);
+	uint64_t end = off + len;
+	if (end > atomic_load_explicit(&mapped.allocated, memory_order_acquire)
+			&& !mapped_grow(off, end))
+		return false;
+	memcpy(mapped.map + off, buf, len);
+	return true;
+}
+
+int mapped_fini(void)
+{
+	uint64_t len = atomic_load(&mapped.used);
+	if (len > mapped.end)
+		len = mapped.end;
+	munmap(mapped.map, MAPPED_WINDOW);
+	return ftruncate(mapped.fd, len);
+}
@@ -0,0 +1,30 @@
+// Memory-mapped output file
+//
+// Instead of going through the writer thread, vCPUs copy their blocks directly into a shared
+// mapping of the output file. Space is reserved with an atomic bump pointer, so that capturing a
+// sample does not require any system call. The file is grown in large extents as the pointer
+// moves forward, and truncated to the used length at exit.
+
+#ifndef MAPPED_H
+#define MAPPED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maps the file `fd`, of which the first `off` bytes have already been written, and preallocates
+// the first extent.
+//
+// On error, the function returns `-1` and sets `errno`.
+int mapped_init(int fd, uint64_t off);
+// Copies the data `buf` of `len` bytes at the end of the output file.
+//
+// This function is safe to call from several threads at once. If the file cannot grow, the data
+// is dropped and the function returns `false`.
+bool mapped_write(const void *buf, size_t len);
+// Unmaps the file and truncates it to the length actually used.
+//
+// On error, the function returns `-1` and sets `errno`.
+int mapped_fini(void);
+
+#endif
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Measures the slowdown of a guest workload caused by the plugin.
+#
+# usage: ./overhead.sh [-r <runs>] [-d '<delays>'] [-a '<plugin arguments>'] [-p <plugin>] \
+#	-- <QEMU command>...
+#
+# The QEMU command must run a fixed workload and exit once it is done, for example by powering off
+# the guest or through the `isa-debug-exit` device. Its exit status is ignored. The command is run
+# without the plugin first, then with the plugin for each delay. Each configuration is run
+# `runs` times (default: 5), and its median wall-clock time is reported along with the slowdown
+# relative to the runs without the plugin and the size of the output file.
+
+set -e
+
+runs=5
+delays='1000 100 10'
+plugin_args=
+plugin=./kern-profile.so
+
+usage() {
+	echo "usage: $0 [-r <runs>] [-d '<delays>'] [-a '<plugin arguments>'] [-p <plugin>] -- <QEMU command>..." >&2
+	exit 1
+}
+
+while getopts r:d:a:p: opt; do
+	case $opt in
+		r) runs=$OPTARG ;;
+		d) delays=$OPTARG ;;
+		a) plugin_args=,$OPTARG ;;
+		p) plugin=$OPTARG ;;
+		*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || usage
+
+out=$(mktemp)
+times=$(mktemp)
+trap 'rm -f "$out" "$times"' EXIT
+
+# Runs the QEMU command `runs` times with the given extra arguments, then prints the median
+# duration in milliseconds
+measure() {
+	: >"$times"
+	i=0
+	while [ $i -lt "$runs" ]; do
+		rm -f "$out"
+		start=$(date +%s%N)
+		"$@" >/dev/null 2>&1 </dev/null || true
+		end=$(date +%s%N)
+		echo $(((end - start) / 1000000)) >>"$times"
+		i=$((i + 1))
+	done
+	sort -n "$times" | sed -n "$(((runs + 1) / 2))p"
+}
+
+qemu=$1
+shift
+printf '%-12s %12s %10s %12s\n' config 'median (ms)' slowdown 'output (KiB)'
+base=$(measure "$qemu" "$@")
+printf '%-12s %12d %10s %12s\n' none "$base" 1.00 -
+for delay in $delays; do
+	ms=$(measure "$qemu" -plugin "$plugin,out=$out,delay=$delay$plugin_args" "$@")
+	size=$(($(wc -c <"$out") / 1024))
+	slowdown=$(echo "$ms $base" | awk '{ printf "%.2f", $1 / $2 }')
+	printf '%-12s %12d %10s %12d\n' "delay=$delay" "$ms" "$slowdown" "$size"
+done
@@ -3,34 +3,135 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
-#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <glib.h>
 
 #include <qemu-plugin.h>
 
+#include "compress.h"
+#include "control.h"
+#include "fold.h"
+#include "format.h"
+#include "kernel.h"
+#include "mapped.h"
+#include "stack.h"
+#include "unwind.h"
+#include "writer.h"
+
 // Hard limit to the stack depth to observe
 #define MAX_DEPTH	64
 
+// The maximum size of a record in bytes (see `format.h`)
+#define RECORD_MAX_SIZE		(1 + 4 * VARINT_MAX_SIZE + MAX_DEPTH * VARINT_MAX_SIZE)
+
 QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
 
+// Per-vCPU sampling state. Each vCPU only touches its own state, so no synchronization is needed
+struct vcpu
+{
+	// The timestamp of the next sample to collect in nanoseconds
+	uint64_t next_sample_ts;
+	// The number of instructions executed by the vCPU
+	uint64_t insn_count;
+	// The value of `insn_count` at which the next sample is collected
+	uint64_t next_sample_insn;
+	// The number of memory accesses made by the vCPU
+	uint64_t access_count;
+	// The value of `access_count` at which the next sample is collected
+	uint64_t next_sample_access;
+
+	// The block in which records are written. Once full, it is pushed on the ring buffer, or
+	// copied to the mapping of the output file
+	struct block block;
+	// The ring buffer in which blocks are pushed. Unused if the output file is mapped
+	struct ring *ring;
+	// The local copy of the stack
+	struct stack stack;
+	// The folded stacks, when aggregating in the plugin
+	struct fold_table folded;
+	// The counters of the vCPU
+	struct format_stats stats;
+} __attribute__((aligned(64)));
+
+// Data attached to a translated block of instructions, with `period`. Blocks with the same
+// instructions share it, so that retranslating a block does not allocate
+struct tb_info
+{
+	// The number of instructions in the block
+	size_t n_insns;
+	// The address of each instruction
+	uint64_t vaddr[];
+};
+
 struct ctx
 {
+	// The ID of the plugin, used to reset its instrumentation
+	qemu_plugin_id_t id;
 	// The FD of the output file
 	int out_fd;
-	// The delay between each sample to be collected in microseconds
-	suseconds_t sample_delay;
-	// The timestamp of the next sample to collect
-	struct timeval next_sample_ts;
+	// The delay between each sample to be collected in nanoseconds
+	uint64_t sample_delay;
+	// The number of instructions between each sample. If zero, sampling is time based (see
+	// `sample_delay`)
+	uint64_t sample_period;
+	// The number of memory accesses between each sample. If non-zero, samples are collected on
+	// memory accesses instead of time or instructions
+	uint64_t access_period;
+	// The kind of memory accesses counted by `access_period`
+	enum qemu_plugin_mem_rw access_rw;
+	// If true, identical stacks are counted in the plugin and only written at exit
+	bool aggregate;
+	// If true, vCPUs write directly to a mapping of the output file (see `mapped.h`)
+	bool mapped;
+	// If true, the counters of each vCPU are written at the end of the output file
+	bool stats;
+
+	// Tells whether samples are collected. Changed at runtime by triggers: the instructions at
+	// `start_addr` and `stop_addr`, writes to `marker_port`, or commands (see `control.h`)
+	atomic_bool armed;
+	// Tells whether blocks are translated with sampling callbacks. This follows `armed` once the
+	// instrumentation has been reset
+	atomic_bool instrumented;
+	// Tells whether a reset of the instrumentation is in progress
+	atomic_bool resetting;
+	// The address of the instruction arming sampling when executed. Zero if unset
+	uint64_t start_addr;
+	// The address of the instruction disarming sampling when executed. Zero if unset
+	uint64_t stop_addr;
+	// The I/O port whose writes arm sampling if the value is non-zero, or disarm it. Negative if
+	// unset
+	int marker_port;
+	// The base address frames are encoded relatively to
+	uint64_t base;
+	// The unwind table. If empty, stacks are unwound by following frame pointers
+	struct unwind_table unwind;
+	// The time at which the plugin has been loaded in nanoseconds. Timestamps of time based
+	// samples are relative to it
+	uint64_t start_ts;
+
+	// The state of each vCPU, indexed by `cpu_index`
+	struct vcpu *vcpus;
+	// The number of elements in `vcpus`
+	size_t vcpus_count;
+
+	// The data attached to translated blocks with `period`, keyed on their content
+	GHashTable *tb_infos;
+	// Protects `tb_infos`, since blocks may be translated by several vCPUs at once
+	pthread_mutex_t tb_infos_lock;
 
 	// sizeof(target_ulong) (include/exec/target_ulong.h)
 	size_t target_ulong_width;
 };
 
-static struct ctx ctx;
+static struct ctx ctx = {
+	.tb_infos_lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
 // The usage of internal QEMU functions are hacks addressing the limitations of
 // TCG plugins. Even though the public API is allowed to change from one version
@@ -38,9 +139,6 @@ static struct ctx ctx;
 
 // Internal QEMU function. Returns the CPU with the given ID.
 extern void *qemu_get_cpu(int index);
-// Internal QEMU function. Allows to read or write guest memory.
-extern int cpu_memory_rw_debug(void *cpu, uint64_t addr,
-                               void *ptr, uint64_t len, bool is_write);
 
 // Returns the value of the register with the given ID.
 static uint64_t get_cpu_register_val(void *cpu, unsigned int id)
@@ -99,97 +197,566 @@ bool in_long_mode(void *cpu) {
 	return efer & (1 << 8);
 }
 
-// This is used as a clock to perform sampling
-static void vcpu_insn_exec(unsigned int cpu_index, void *eip)
+// Returns the value of the CR3 register, identifying the current address space.
+static uint64_t get_cpu_cr3(void *cpu)
 {
-	// If the delay isn't expired, ignore
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	if (tv.tv_sec < ctx.next_sample_ts.tv_sec
-		|| (tv.tv_sec == ctx.next_sample_ts.tv_sec
-		&& tv.tv_usec < ctx.next_sample_ts.tv_usec))
+	// XXX: `cr` follows the segments caches in CPUX86State
+	switch (ctx.target_ulong_width) {
+		case 4: // 32-bits
+			return *(uint32_t *)(cpu + 0x28b0);
+		case 8: // 64-bits
+			return *(uint64_t *)(cpu + 0x2980);
+		default:
+			__builtin_unreachable();
+	}
+}
+
+// Returns the current value of the monotonic clock in nanoseconds.
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Pushes the block of the vCPU on its ring buffer, or copies it to the mapping of the output file,
+// then empties it. If there is no space left, the samples are dropped.
+static void vcpu_flush(unsigned int cpu_index)
+{
+	struct vcpu *vcpu = &ctx.vcpus[cpu_index];
+	if (!vcpu->block.records)
 		return;
-	ctx.next_sample_ts = tv;
-	ctx.next_sample_ts.tv_sec += ctx.sample_delay / 1000000;
-	ctx.next_sample_ts.tv_usec += ctx.sample_delay % 1000000;
+	size_t len;
+	uint8_t *data = block_finish(&vcpu->block, cpu_index, &len);
+	bool ok = ctx.mapped ? mapped_write(data, len) : ring_push(vcpu->ring, data, len);
+	if (ok)
+		vcpu->stats.bytes += len;
+	else
+		vcpu->stats.drops += vcpu->block.records;
+	block_reset(&vcpu->block);
+}
 
-	// The sample delay has expired. Read the stack and write it to the output file
+// The reason why unwinding a stack stopped
+enum unwind_end
+{
+	// The outermost frame has been reached
+	UNWIND_END_COMPLETE,
+	// The stack is deeper than `MAX_DEPTH`
+	UNWIND_END_MAX_DEPTH,
+	// The stack could not be read
+	UNWIND_END_READ_ERROR,
+};
+
+// Reads the frame pushed by the CPU when taking an interrupt or exception, right above `addr`,
+// and stores the address of the interrupted instruction in `pc`. The function returns false if
+// there is no such frame.
+static bool read_interrupt_frame(struct stack *stack, void *cpu, uint64_t asid, uint64_t addr,
+		uint8_t ptr_width, uint64_t *pc)
+{
+	// Some exceptions push an error code first
+	for (int i = 0; i < 2; i++)
+	{
+		uint64_t frame = addr + i * ptr_width;
+		uint64_t cs, flags;
+		if (!stack_read(stack, cpu, asid, frame, ptr_width, pc)
+				|| !stack_read(stack, cpu, asid, frame + ptr_width, ptr_width, &cs)
+				|| !stack_read(stack, cpu, asid, frame + 2 * ptr_width, ptr_width, &flags))
+			return false;
+		// A segment selector fits in 16 bits, and only the low 22 bits of EFLAGS are defined, bit
+		// 1 being always set
+		if (cs && cs <= 0xffff && (flags & 0x2) && flags < (1 << 22))
+			return true;
+	}
+	return false;
+}
+
+// Unwinds the stack of `cpu` by following the chain of saved frame pointers. The first element of
+// `frames` must be the address of the instruction being executed. The function returns the number
+// of frames written to `frames`, and stores the reason why unwinding stopped in `end`.
+//
+// The entry code of interrupts and exceptions sets up a frame with a null return address right
+// below the frame pushed by the CPU, and its saved frame pointer is the one of the interrupted
+// code. Unwinding continues through it, and the frames where an interrupt or exception was taken
+// are marked in `contexts` (see `FORMAT_FLAG_CONTEXTS`).
+static uint8_t unwind_frame_pointers(struct stack *stack, void *cpu, uint64_t asid,
+		uint8_t ptr_width, uint64_t *frames, uint64_t *contexts, enum unwind_end *end)
+{
+	uint64_t frame_ptr = get_cpu_register_val(cpu, 5);
+	*end = UNWIND_END_MAX_DEPTH;
+	uint8_t i;
+	for (i = 1; i < MAX_DEPTH; ++i)
+	{
+		// A null frame pointer marks the end of the chain
+		if (!frame_ptr)
+		{
+			*end = UNWIND_END_COMPLETE;
+			break;
+		}
+		// The next frame is read first since it is at the lowest address, so that the page is
+		// copied from there
+		uint64_t next_frame_ptr;
+		// Get function address (return address on the stack)
+		if (!stack_read(stack, cpu, asid, frame_ptr, ptr_width, &next_frame_ptr)
+				|| !stack_read(stack, cpu, asid, frame_ptr + ptr_width, ptr_width, &frames[i]))
+		{
+			*end = UNWIND_END_READ_ERROR;
+			break;
+		}
+		// The outermost frame may have a null return address as well
+		if (!frames[i] && !next_frame_ptr)
+		{
+			*end = UNWIND_END_COMPLETE;
+			break;
+		}
+		// If the interrupted instruction cannot be found, the frame is left null so that the
+		// aggregator shows it as unknown
+		if (!frames[i])
+		{
+			read_interrupt_frame(stack, cpu, asid, frame_ptr + 2 * ptr_width, ptr_width, &frames[i]);
+			*contexts |= 1ull << i;
+		}
+		// Frames outside of the kernel are resolved by the aggregator, if given their image
+		frame_ptr = next_frame_ptr;
+	}
+	return i;
+}
+
+// Same as `unwind_frame_pointers`, using the unwind table instead, so that frame pointers are not
+// required.
+static uint8_t unwind_cfi(struct stack *stack, void *cpu, uint64_t asid, uint8_t ptr_width,
+		uint64_t *frames, enum unwind_end *end)
+{
+	uint64_t sp = get_cpu_register_val(cpu, 4);
+	uint64_t bp = get_cpu_register_val(cpu, 5);
+	uint64_t pc = frames[0];
+	*end = UNWIND_END_MAX_DEPTH;
+	uint8_t i;
+	for (i = 1; i < MAX_DEPTH; ++i)
+	{
+		// A return address points right after the call instruction, which may be the end of the
+		// function
+		const struct unwind_entry *ent = unwind_table_find(&ctx.unwind, i == 1 ? pc : pc - 1);
+		if (!ent)
+		{
+			*end = UNWIND_END_COMPLETE;
+			break;
+		}
+		uint64_t cfa = (ent->cfa_reg == UNWIND_CFA_SP ? sp : bp) + ent->cfa_off;
+		// The saved frame pointer is read first since it is at the lowest address
+		if ((ent->bp_rule == UNWIND_BP_AT_CFA
+				&& !stack_read(stack, cpu, asid, cfa + ent->bp_off, ptr_width, &bp))
+				|| !stack_read(stack, cpu, asid, cfa - ptr_width, ptr_width, &pc))
+		{
+			*end = UNWIND_END_READ_ERROR;
+			break;
+		}
+		if (!pc)
+		{
+			*end = UNWIND_END_COMPLETE;
+			break;
+		}
+		frames[i] = pc;
+		sp = cfa;
+	}
+	return i;
+}
+
+// Collects a sample: reads the stack of the given CPU and pushes it to the vCPU's ring buffer.
+//
+// `eip` is the address of the instruction being executed. `ts` is the timestamp of the sample
+// (see `FORMAT_FLAG_TIMESTAMPS`).
+static void __attribute__((noinline)) sample(unsigned int cpu_index, uint64_t eip, uint64_t ts)
+{
+	// Blocks translated before sampling has been disarmed may still run until the reset
+	if (!atomic_load_explicit(&ctx.armed, memory_order_relaxed))
+		return;
+	struct vcpu *vcpu = &ctx.vcpus[cpu_index];
+	uint64_t start = now_ns();
+	vcpu->stats.samples++;
 
 	// Get registers
 	void *cpu = qemu_get_cpu(cpu_index);
-	uint64_t frame_ptr = get_cpu_register_val(cpu, 5);
+	uint64_t asid = get_cpu_cr3(cpu);
 
 	bool long_mode = in_long_mode(cpu);
 	uint8_t ptr_width = long_mode ? 8 : 4;
 
-	// Iterate through stack
-	uint64_t frames_buf[MAX_DEPTH];
-	frames_buf[0] = (uint64_t) eip;
+	// Iterate through stack. Pages are copied once, when the first frame they contain is reached.
+	// The first elements of the buffer are the address space tag and the contexts of the stack, so
+	// that stacks of different address spaces or interrupted at different frames are folded apart
+	struct stack *stack = &vcpu->stack;
+	stack_reset(stack);
+	uint64_t frames_buf[2 + MAX_DEPTH];
+	uint64_t *frames = &frames_buf[2];
+	frames_buf[0] = format_asid(asid);
+	frames_buf[1] = 0;
+	frames[0] = eip;
 	uint8_t i;
+	enum unwind_end end;
+	if (ctx.unwind.count && ctx.unwind.ptr_width == ptr_width)
+		i = unwind_cfi(stack, cpu, asid, ptr_width, frames, &end);
+	else
+		i = unwind_frame_pointers(stack, cpu, asid, ptr_width, frames, &frames_buf[1], &end);
+	if (end == UNWIND_END_MAX_DEPTH)
+		vcpu->stats.max_depth++;
+	else if (end == UNWIND_END_READ_ERROR)
+		vcpu->stats.read_errors++;
+
+	if (ctx.aggregate)
+	{
+		if (!fold_table_add(&vcpu->folded, frames_buf, 2 + i))
+			vcpu->stats.drops++;
+	}
+	else
+	{
+		// Write record
+		struct block *block = &vcpu->block;
+		block->len += varint_put(block_tail(block), ts - block->last_ts);
+		block->last_ts = ts;
+		block->len += block_put_asid(block, block_tail(block), frames_buf[0]);
+		block->len += varint_put(block_tail(block), frames_buf[1]);
+		block->len += format_put_stack(block_tail(block), ctx.base, frames, i, 0);
+		block->records++;
+		if (block->len + RECORD_MAX_SIZE > BLOCK_SIZE)
+			vcpu_flush(cpu_index);
+	}
+	vcpu->stats.sample_ns += now_ns() - start;
+}
 
-	char buf[8]; // We'll overallocate for 32-bit. It's fine.
-	for (i = 1; i < MAX_DEPTH; ++i)
-    {
-		// TODO do only one read in memory
+// Executed each time a block of instructions is executed. This is used as a clock to perform
+// time based sampling
+//
+// `udata` is the address of the first instruction of the block.
+static void vcpu_tb_exec(unsigned int cpu_index, void *udata)
+{
+	struct vcpu *vcpu = &ctx.vcpus[cpu_index];
+	// If the delay isn't expired, ignore
+	uint64_t now = now_ns();
+	if (now < vcpu->next_sample_ts)
+		return;
+	vcpu->next_sample_ts = now + ctx.sample_delay;
+	sample(cpu_index, (uintptr_t) udata, now - ctx.start_ts);
+}
 
-		// Get function address (return address on the stack)
-		int err = cpu_memory_rw_debug(cpu, frame_ptr + ptr_width, buf, ctx.target_ulong_width, false);
-		if (err)
-			break;
+// Executed each time a block of instructions is executed. This is used as a clock to perform
+// instruction count based sampling
+//
+// The count is updated for the whole block before it executes, so it may be slightly off when an
+// exception interrupts the block.
+static void vcpu_tb_exec_period(unsigned int cpu_index, void *udata)
+{
+	struct tb_info *tb = udata;
+	struct vcpu *vcpu = &ctx.vcpus[cpu_index];
+	uint64_t start = vcpu->insn_count;
+	vcpu->insn_count += tb->n_insns;
+	if (vcpu->insn_count <= vcpu->next_sample_insn)
+		return;
+	// The period expires in this block. Attribute the sample to the exact instruction
+	uint64_t ts = vcpu->next_sample_insn;
+	uint64_t vaddr = tb->vaddr[ts - start];
+	// If the period is shorter than the block, only one sample is collected
+	do
+		vcpu->next_sample_insn += ctx.sample_period;
+	while (vcpu->next_sample_insn < vcpu->insn_count);
+	sample(cpu_index, vaddr, ts);
+}
 
-		if (long_mode) {
-			frames_buf[i] = *(uint64_t *) &buf[0];
-		} else {
-			frames_buf[i] = *(uint32_t *) &buf[0];
-		}
-		
-		// XXX: Any frames outside the kernel are discarded in the parser.
-		//
-		// Get next frame
-		err = cpu_memory_rw_debug(cpu, frame_ptr, buf, ctx.target_ulong_width, false);
-		if (err)
-			break;
+// Executed on each memory access of kind `access_rw`. `udata` is the address of the instruction
+// making the access. This is used as a clock to perform memory access based sampling
+//
+// The callback is kept as short as possible, since it runs on every access. Collecting the sample
+// itself is out of line.
+static void vcpu_mem_access(unsigned int cpu_index, qemu_plugin_meminfo_t info, uint64_t vaddr,
+		void *udata)
+{
+	struct vcpu *vcpu = &ctx.vcpus[cpu_index];
+	uint64_t ts = vcpu->access_count++;
+	if (ts < vcpu->next_sample_access)
+		return;
+	vcpu->next_sample_access += ctx.access_period;
+	sample(cpu_index, (uintptr_t) udata, ts);
+}
 
-		if (long_mode) {
-			frame_ptr = *(uint64_t *) &buf[0];
-		} else {
-			frame_ptr = *(uint32_t *) &buf[0];
-		}
-	}
+// Defined below, since it registers the callbacks of the plugin again
+static void plugin_reset(qemu_plugin_id_t id);
+
+// Resets the instrumentation if blocks are not translated according to whether sampling is armed,
+// so that no sampling callbacks are left while disarmed. This must be called from a vCPU thread:
+// the translated blocks are flushed once all vCPUs are stopped.
+static void update_instrumentation(void)
+{
+	bool armed = atomic_load(&ctx.armed);
+	// Changes made during a reset are applied by the next call once it is done
+	if (armed == atomic_load(&ctx.instrumented) || atomic_exchange(&ctx.resetting, true))
+		return;
+	atomic_store(&ctx.instrumented, armed);
+	qemu_plugin_reset(ctx.id, plugin_reset);
+}
 
-	// Build iovec
-	struct iovec v[2];
-	// Frames count
-	v[0].iov_base = (void *) &i;
-	v[0].iov_len = sizeof(i);
-	// Frames
-	v[1].iov_base = (void *) &frames_buf[0];
-	v[1].iov_len = i * sizeof(uint64_t);
+// Executed when the instruction at `start_addr` or `stop_addr` is executed. `udata` is non-null
+// for the former
+static void vcpu_trigger(unsigned int cpu_index, void *udata)
+{
+	atomic_store(&ctx.armed, udata != NULL);
+	update_instrumentation();
+}
 
-	// TODO loop until everything is written
-	errno = 0;
-	writev(ctx.out_fd, v, 2);
-	if (errno)
-		dprintf(STDERR_FILENO, "warning: could not write to output file: %s\n", strerror(errno));
+// Executed when an instruction writing to `marker_port` is executed. `udata` is non-null if the
+// port is given by DX, in which case it is only known now
+static void vcpu_marker(unsigned int cpu_index, void *udata)
+{
+	void *cpu = qemu_get_cpu(cpu_index);
+	if (udata && (get_cpu_register_val(cpu, 2) & 0xffff) != ctx.marker_port)
+		return;
+	atomic_store(&ctx.armed, (get_cpu_register_val(cpu, 0) & 0xff) != 0);
+	update_instrumentation();
+}
+
+// Executed each time a vCPU resumes from idle. Commands may have changed whether sampling is armed
+// while no block was translated
+static void vcpu_resume(qemu_plugin_id_t id, unsigned int cpu_index)
+{
+	update_instrumentation();
+}
+
+// Hashes the instructions of a block, for `tb_infos`.
+static guint tb_info_hash(gconstpointer key)
+{
+	const struct tb_info *info = key;
+	uint64_t hash = info->n_insns;
+	for (size_t i = 0; i < info->n_insns; i++)
+		hash = hash * 31 + info->vaddr[i];
+	return hash ^ (hash >> 32);
+}
+
+// Tells whether two blocks have the same instructions, for `tb_infos`.
+static gboolean tb_info_equal(gconstpointer a, gconstpointer b)
+{
+	const struct tb_info *info_a = a, *info_b = b;
+	return info_a->n_insns == info_b->n_insns
+		&& !memcmp(info_a->vaddr, info_b->vaddr, info_a->n_insns * sizeof(uint64_t));
+}
+
+// Returns the data attached to the block, shared with the previous translations of a block with
+// the same instructions.
+static struct tb_info *tb_info_get(struct qemu_plugin_tb *tb, size_t n)
+{
+	struct tb_info *info = g_malloc(sizeof(struct tb_info) + n * sizeof(uint64_t));
+	info->n_insns = n;
+	for (size_t i = 0; i < n; i++)
+		info->vaddr[i] = qemu_plugin_insn_vaddr(qemu_plugin_tb_get_insn(tb, i));
+	pthread_mutex_lock(&ctx.tb_infos_lock);
+	struct tb_info *existing = g_hash_table_lookup(ctx.tb_infos, info);
+	if (existing)
+	{
+		g_free(info);
+		info = existing;
+	}
+	else
+		g_hash_table_add(ctx.tb_infos, info);
+	pthread_mutex_unlock(&ctx.tb_infos_lock);
+	return info;
+}
+
+// Registers the callbacks of the instructions of the block that arm or disarm sampling.
+static void register_triggers(struct qemu_plugin_tb *tb, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+	{
+		struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+		uint64_t vaddr = qemu_plugin_insn_vaddr(insn);
+		if (ctx.start_addr && vaddr == ctx.start_addr)
+			qemu_plugin_register_vcpu_insn_exec_cb(insn, vcpu_trigger, QEMU_PLUGIN_CB_NO_REGS,
+					(void *) 1);
+		if (ctx.stop_addr && vaddr == ctx.stop_addr)
+			qemu_plugin_register_vcpu_insn_exec_cb(insn, vcpu_trigger, QEMU_PLUGIN_CB_NO_REGS,
+					NULL);
+		if (ctx.marker_port < 0)
+			continue;
+		const uint8_t *data = qemu_plugin_insn_data(insn);
+		size_t size = qemu_plugin_insn_size(insn);
+		// out imm8, al
+		if (size == 2 && data[0] == 0xe6 && data[1] == ctx.marker_port)
+			qemu_plugin_register_vcpu_insn_exec_cb(insn, vcpu_marker, QEMU_PLUGIN_CB_R_REGS, NULL);
+		// out dx, al
+		else if (size == 1 && data[0] == 0xee)
+			qemu_plugin_register_vcpu_insn_exec_cb(insn, vcpu_marker, QEMU_PLUGIN_CB_R_REGS,
+					(void *) 1);
+	}
 }
 
 // Executed each time a block of instructions is translated
 static void vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb *tb)
 {
-    size_t n = qemu_plugin_tb_n_insns(tb);
-    size_t i;
-    for (i = 0; i < n; i++) {
-        struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
-		uint64_t vaddr = qemu_plugin_insn_vaddr(insn);
-		qemu_plugin_register_vcpu_insn_exec_cb(
-			insn, vcpu_insn_exec, QEMU_PLUGIN_CB_NO_REGS,
-			GUINT_TO_POINTER(vaddr));
-    }
+	size_t n = qemu_plugin_tb_n_insns(tb);
+	update_instrumentation();
+	register_triggers(tb, n);
+	if (!atomic_load(&ctx.instrumented))
+		return;
+	if (ctx.access_period)
+	{
+		// Instructions that do not access memory never call the callback
+		for (size_t i = 0; i < n; i++)
+		{
+			struct qemu_plugin_insn *insn = qemu_plugin_tb_get_insn(tb, i);
+			void *vaddr = (void *) (uintptr_t) qemu_plugin_insn_vaddr(insn);
+			qemu_plugin_register_vcpu_mem_cb(insn, vcpu_mem_access, QEMU_PLUGIN_CB_NO_REGS,
+					ctx.access_rw, vaddr);
+		}
+		return;
+	}
+	// A single callback per block is enough since the sampling clock does not need to be more
+	// precise than the duration of a block
+	if (ctx.sample_period)
+		qemu_plugin_register_vcpu_tb_exec_cb(tb, vcpu_tb_exec_period, QEMU_PLUGIN_CB_NO_REGS,
+				tb_info_get(tb, n));
+	else
+		qemu_plugin_register_vcpu_tb_exec_cb(tb, vcpu_tb_exec, QEMU_PLUGIN_CB_NO_REGS,
+				(void *) (uintptr_t) qemu_plugin_tb_vaddr(tb));
+}
+
+// Writes the stacks folded by the given vCPU to the output file.
+static void write_folded(unsigned int cpu_index)
+{
+	struct vcpu *vcpu = &ctx.vcpus[cpu_index];
+	struct fold_table *table = &vcpu->folded;
+	struct block *block = &vcpu->block;
+	for (size_t i = 0; i <= table->capacity; i++)
+	{
+		// Write the block when full, or after the last entry
+		if (block->records && (i == table->capacity || block->len + RECORD_MAX_SIZE > BLOCK_SIZE))
+		{
+			struct iovec v;
+			v.iov_base = block_finish(block, cpu_index, &v.iov_len);
+			block_reset(block);
+			if (write_all(ctx.out_fd, &v, 1) < 0)
+			{
+				dprintf(STDERR_FILENO, "warning: could not write to output file: %s\n", strerror(errno));
+				return;
+			}
+			vcpu->stats.bytes += v.iov_len;
+		}
+		if (i == table->capacity)
+			break;
+		struct fold_entry *ent = &table->entries[i];
+		if (!ent->count)
+			continue;
+		// The first elements are the address space tag and the contexts (see `sample`)
+		const uint64_t *key = &table->frames[ent->off];
+		block->len += block_put_asid(block, block_tail(block), key[0]);
+		block->len += varint_put(block_tail(block), key[1]);
+		block->len += format_put_stack(block_tail(block), ctx.base, &key[2], ent->depth - 2,
+				ent->count);
+		block->records++;
+	}
+}
+
+// Writes the counters of each vCPU at the end of the output file (see `FORMAT_FLAG_STATS`). This
+// must be called once all samples have been written.
+static void write_stats(void)
+{
+	for (size_t i = 0; i < ctx.vcpus_count; i++)
+	{
+		uint8_t buf[STATS_MAX_SIZE];
+		struct iovec v = { .iov_base = buf };
+		v.iov_len = format_put_stats(buf, i, &ctx.vcpus[i].stats);
+		bool ok = ctx.mapped ? mapped_write(buf, v.iov_len) : write_all(ctx.out_fd, &v, 1) >= 0;
+		if (!ok)
+		{
+			dprintf(STDERR_FILENO, "warning: could not write counters to output file: %s\n", strerror(errno));
+			return;
+		}
+	}
+}
+
+// Prints the given counters, labeled with `name`.
+static void print_counters(const char *name, const struct format_stats *stats)
+{
+	dprintf(STDERR_FILENO, "kern-profile: %s: %lu samples (%lu dropped), %lu truncated at depth %d, %lu unwinding errors, %lu bytes (uncompressed), %lu ns per sample\n",
+			name, stats->samples, stats->drops, stats->max_depth, MAX_DEPTH, stats->read_errors,
+			stats->bytes, stats->samples ? stats->sample_ns / stats->samples : 0);
+}
+
+// Prints the counters of each vCPU, then their sum.
+static void print_stats(void)
+{
+	struct format_stats total = { 0 };
+	for (size_t i = 0; i < ctx.vcpus_count; i++)
+	{
+		const struct format_stats *stats = &ctx.vcpus[i].stats;
+		char name[32];
+		snprintf(name, sizeof(name), "vCPU %zu", i);
+		print_counters(name, stats);
+		total.samples += stats->samples;
+		total.drops += stats->drops;
+		total.max_depth += stats->max_depth;
+		total.read_errors += stats->read_errors;
+		total.bytes += stats->bytes;
+		total.sample_ns += stats->sample_ns;
+	}
+	print_counters("total", &total);
+	// Compressed frames mix the samples of all vCPUs, so only their total size is known
+	uint64_t compressed = writer_compressed_bytes();
+	if (compressed)
+		dprintf(STDERR_FILENO, "kern-profile: total: %lu bytes written after compression\n", compressed);
 }
 
 static void plugin_exit(qemu_plugin_id_t id, void *p)
 {
+	uint64_t drops = 0;
+	if (ctx.aggregate)
+	{
+		for (size_t i = 0; i < ctx.vcpus_count; i++)
+		{
+			write_folded(i);
+			fold_table_fini(&ctx.vcpus[i].folded);
+		}
+		if (ctx.stats)
+			write_stats();
+	}
+	else
+	{
+		for (size_t i = 0; i < ctx.vcpus_count; i++)
+			vcpu_flush(i);
+		// The writer thread is stopped first so that the counters include everything it wrote
+		if (!ctx.mapped)
+			writer_fini();
+		if (ctx.stats)
+			write_stats();
+		if (ctx.mapped && mapped_fini() < 0)
+			dprintf(STDERR_FILENO, "warning: could not truncate output file: %s\n", strerror(errno));
+	}
+	print_stats();
+	for (size_t i = 0; i < ctx.vcpus_count; i++)
+		drops += ctx.vcpus[i].stats.drops;
+	if (drops && ctx.aggregate)
+		dprintf(STDERR_FILENO, "warning: %lu samples have been dropped because memory could not be allocated\n", drops);
+	else if (drops && ctx.mapped)
+		dprintf(STDERR_FILENO, "warning: %lu samples have been dropped because the output file could not grow\n", drops);
+	else if (drops)
+		dprintf(STDERR_FILENO, "warning: %lu samples have been dropped because the output could not keep up, consider increasing `buffer`\n", drops);
 	close(ctx.out_fd);
+	for (size_t i = 0; i < ctx.vcpus_count; i++)
+		stack_fini(&ctx.vcpus[i].stack);
+	free(ctx.vcpus);
+	unwind_table_fini(&ctx.unwind);
+	if (ctx.tb_infos)
+		g_hash_table_destroy(ctx.tb_infos);
+}
+
+// Registers the callbacks of the plugin.
+static void register_callbacks(qemu_plugin_id_t id)
+{
+	qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
+	qemu_plugin_register_vcpu_resume_cb(id, vcpu_resume);
+	qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+}
+
+// Executed once the instrumentation has been reset, which unregisters all the callbacks.
+static void plugin_reset(qemu_plugin_id_t id)
+{
+	register_callbacks(id);
+	atomic_store(&ctx.resetting, false);
 }
 
 QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
@@ -207,7 +774,23 @@ QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
 
 	// Default values
 	char *out_path = "qemu-profile";
-	suseconds_t sample_delay = 10;
+	char *kernel_path = NULL;
+	char *unwind_path = NULL;
+	uint64_t sample_delay = 10;
+	uint64_t sample_period = 0;
+	uint64_t access_period = 0;
+	enum qemu_plugin_mem_rw access_rw = QEMU_PLUGIN_MEM_RW;
+	size_t buffer_size = 1024;
+	size_t stack_window = 16;
+	bool aggregate = false;
+	bool mapped = false;
+	bool stats = false;
+	enum compress_algo compress = COMPRESS_NONE;
+	uint64_t start_addr = 0;
+	uint64_t stop_addr = 0;
+	int marker_port = -1;
+	char *control_path = NULL;
+	int armed = -1;
 	// Parse arguments
 	for (size_t i = 0; i < argc; ++i)
 	{
@@ -217,8 +800,46 @@ QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
 		*name_end = '\0';
 		if (g_strcmp0(name, "out") == 0)
 			out_path = val;
+		else if (g_strcmp0(name, "kernel") == 0)
+			kernel_path = val;
+		else if (g_strcmp0(name, "unwind") == 0)
+			unwind_path = val;
 		else if (g_strcmp0(name, "delay") == 0)
 			sample_delay = atoi(val);
+		else if (g_strcmp0(name, "period") == 0)
+			sample_period = g_ascii_strtoull(val, NULL, 10);
+		else if (g_strcmp0(name, "access_period") == 0)
+			access_period = g_ascii_strtoull(val, NULL, 10);
+		else if (g_strcmp0(name, "access_rw") == 0 && g_strcmp0(val, "r") == 0)
+			access_rw = QEMU_PLUGIN_MEM_R;
+		else if (g_strcmp0(name, "access_rw") == 0 && g_strcmp0(val, "w") == 0)
+			access_rw = QEMU_PLUGIN_MEM_W;
+		else if (g_strcmp0(name, "access_rw") == 0 && g_strcmp0(val, "rw") == 0)
+			access_rw = QEMU_PLUGIN_MEM_RW;
+		else if (g_strcmp0(name, "buffer") == 0)
+			buffer_size = g_ascii_strtoull(val, NULL, 10);
+		else if (g_strcmp0(name, "stack") == 0)
+			stack_window = g_ascii_strtoull(val, NULL, 10);
+		else if (g_strcmp0(name, "aggregate") == 0)
+			aggregate = atoi(val) != 0;
+		else if (g_strcmp0(name, "mmap") == 0)
+			mapped = atoi(val) != 0;
+		else if (g_strcmp0(name, "stats") == 0)
+			stats = atoi(val) != 0;
+		else if (g_strcmp0(name, "start") == 0)
+			start_addr = g_ascii_strtoull(val, NULL, 16);
+		else if (g_strcmp0(name, "stop") == 0)
+			stop_addr = g_ascii_strtoull(val, NULL, 16);
+		else if (g_strcmp0(name, "marker") == 0)
+			marker_port = g_ascii_strtoull(val, NULL, 0) & 0xffff;
+		else if (g_strcmp0(name, "control") == 0)
+			control_path = val;
+		else if (g_strcmp0(name, "armed") == 0)
+			armed = atoi(val) != 0;
+		else if (g_strcmp0(name, "compress") == 0 && g_strcmp0(val, "zstd") == 0)
+			compress = COMPRESS_ZSTD;
+		else if (g_strcmp0(name, "compress") == 0 && g_strcmp0(val, "lz4") == 0)
+			compress = COMPRESS_LZ4;
 		else
 		{
 			dprintf(STDERR_FILENO, "invalid argument: %s\n", name);
@@ -226,20 +847,159 @@ QEMU_PLUGIN_EXPORT int qemu_plugin_install(qemu_plugin_id_t id,
 		}
 	}
 
+	// Only the writer thread compresses the output
+	if (compress != COMPRESS_NONE && (aggregate || mapped))
+	{
+		dprintf(STDERR_FILENO, "compress cannot be used with aggregate or mmap\n");
+		return -1;
+	}
+
+	// Read kernel information
+	struct kernel_info kernel = { 0 };
+	if (kernel_path && kernel_read_info(kernel_path, &kernel) < 0)
+	{
+		dprintf(STDERR_FILENO, "qemu: %s: %s", kernel_path, strerror(errno));
+		return 1;
+	}
+	ctx.base = kernel.base;
+
+	// Load unwind table
+	if (unwind_path && unwind_table_load(unwind_path, &ctx.unwind) < 0)
+	{
+		dprintf(STDERR_FILENO, "qemu: %s: %s", unwind_path, strerror(errno));
+		return 1;
+	}
+
 	// Open output file
 	errno = 0;
-	ctx.out_fd = open(out_path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	// Mapping the file requires read access
+	ctx.out_fd = open(out_path, O_CREAT | O_TRUNC | (mapped ? O_RDWR : O_WRONLY), 0666);
 	if (errno)
 	{
 		dprintf(STDERR_FILENO, "qemu: %s: %s", out_path, strerror(errno));
 		return 1;
 	}
 
-	// Init timing
-	ctx.sample_delay = sample_delay;
-	gettimeofday(&ctx.next_sample_ts, NULL);
+	// Init vCPUs
+	ctx.vcpus_count = info->system_emulation ? info->system.max_vcpus : 1;
+	ctx.vcpus = aligned_alloc(64, ctx.vcpus_count * sizeof(struct vcpu));
+	if (!ctx.vcpus)
+	{
+		dprintf(STDERR_FILENO, "qemu: cannot allocate vCPUs state: %s", strerror(errno));
+		return 1;
+	}
+	memset(ctx.vcpus, 0, ctx.vcpus_count * sizeof(struct vcpu));
+	for (size_t i = 0; i < ctx.vcpus_count; i++)
+	{
+		if (stack_init(&ctx.vcpus[i].stack, stack_window * 1024) < 0)
+		{
+			dprintf(STDERR_FILENO, "qemu: cannot allocate vCPUs state: %s", strerror(errno));
+			return 1;
+		}
+	}
+
+	// Write file header
+	uint8_t sample_mode = SAMPLE_MODE_TIME;
+	uint64_t sample_interval = sample_delay * 1000;
+	if (access_period)
+	{
+		sample_mode = SAMPLE_MODE_ACCESSES;
+		sample_interval = access_period;
+	}
+	else if (sample_period)
+	{
+		sample_mode = SAMPLE_MODE_INSNS;
+		sample_interval = sample_period;
+	}
+	struct format_header hdr = {
+		.ptr_width = ctx.target_ulong_width,
+		.flags = FORMAT_FLAG_ADDRESS_SPACES | FORMAT_FLAG_CONTEXTS
+			| (aggregate ? FORMAT_FLAG_AGGREGATED : FORMAT_FLAG_TIMESTAMPS)
+			| (stats ? FORMAT_FLAG_STATS : 0),
+		.sample_mode = sample_mode,
+		.build_id_len = kernel.build_id_len,
+		.vcpus = ctx.vcpus_count,
+		.sample_interval = sample_interval,
+		.base = ctx.base,
+	};
+	memcpy(hdr.build_id, kernel.build_id, kernel.build_id_len);
+	uint8_t hdr_buf[32 + FORMAT_BUILD_ID_MAX];
+	size_t hdr_len = format_put_header(hdr_buf, &hdr);
+	struct iovec v = { .iov_base = hdr_buf, .iov_len = hdr_len };
+	if (write_all(ctx.out_fd, &v, 1) < 0)
+	{
+		dprintf(STDERR_FILENO, "qemu: %s: %s", out_path, strerror(errno));
+		return 1;
+	}
+
+	ctx.aggregate = aggregate;
+	ctx.stats = stats;
+	if (aggregate)
+	{
+		// Nothing is written before exit
+		for (size_t i = 0; i < ctx.vcpus_count; i++)
+		{
+			if (fold_table_init(&ctx.vcpus[i].folded) < 0)
+			{
+				dprintf(STDERR_FILENO, "qemu: cannot allocate vCPUs state: %s", strerror(errno));
+				return 1;
+			}
+		}
+	}
+	else if (mapped)
+	{
+		ctx.mapped = true;
+		if (mapped_init(ctx.out_fd, hdr_len) < 0)
+		{
+			dprintf(STDERR_FILENO, "qemu: %s: cannot map output file: %s", out_path, strerror(errno));
+			return 1;
+		}
+	}
+	else
+	{
+		// Start writer. The size of ring buffers is rounded up to a power of two, large enough to
+		// hold a full block, which could never be pushed otherwise
+		size_t ring_size = 4096;
+		while (ring_size < buffer_size * 1024 || ring_size < BLOCK_HEADER_MAX_SIZE + BLOCK_SIZE)
+			ring_size <<= 1;
+		if (writer_init(ctx.out_fd, ctx.vcpus_count, ring_size, compress) < 0)
+		{
+			dprintf(STDERR_FILENO, "qemu: cannot start writer: %s", strerror(errno));
+			return 1;
+		}
+		for (size_t i = 0; i < ctx.vcpus_count; i++)
+			ctx.vcpus[i].ring = writer_ring(i);
+	}
 
-    qemu_plugin_register_vcpu_tb_trans_cb(id, vcpu_tb_trans);
-    qemu_plugin_register_atexit_cb(id, plugin_exit, NULL);
+	// Start control thread
+	if (control_path && control_init(control_path, &ctx.armed) < 0)
+	{
+		dprintf(STDERR_FILENO, "qemu: %s: %s", control_path, strerror(errno));
+		return 1;
+	}
+
+	// Init triggers. By default, sampling waits for one if there is any
+	if (armed < 0)
+		armed = !start_addr && marker_port < 0 && !control_path;
+	ctx.id = id;
+	ctx.start_addr = start_addr;
+	ctx.stop_addr = stop_addr;
+	ctx.marker_port = marker_port;
+	atomic_store(&ctx.armed, armed);
+	atomic_store(&ctx.instrumented, armed);
+
+	// Init timing
+	ctx.sample_delay = sample_delay * 1000;
+	ctx.sample_period = sample_period;
+	if (sample_period)
+		ctx.tb_infos = g_hash_table_new_full(tb_info_hash, tb_info_equal, g_free, NULL);
+	ctx.access_period = access_period;
+	ctx.access_rw = access_rw;
+	uint64_t now = now_ns();
+	ctx.start_ts = now;
+	for (size_t i = 0; i < ctx.vcpus_count; i++)
+		ctx.vcpus[i].next_sample_ts = now;
+
+	register_callbacks(id);
 	return 0;
 }
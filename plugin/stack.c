@@ -0,0 +1,104 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stack.h"
+
+// Internal QEMU function. Returns the physical address of the page containing the given virtual
+// address, or `-1` if not mapped.
+extern uint64_t cpu_get_phys_page_debug(void *cpu, uint64_t addr);
+// Internal QEMU function. Allows to read or write guest physical memory.
+extern void cpu_physical_memory_rw(uint64_t addr, void *buf, uint64_t len, bool is_write);
+
+int stack_init(struct stack *stack, size_t window)
+{
+	// Mark all translations as invalid
+	memset(stack->tlb, 0xff, sizeof(stack->tlb));
+	stack->pages_count = 0;
+	stack->pages_max = (window + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (stack->pages_max == 0)
+		stack->pages_max = 1;
+	stack->pages = malloc(stack->pages_max * sizeof(struct stack_page));
+	stack->data = malloc(stack->pages_max * PAGE_SIZE);
+	if (!stack->pages || !stack->data)
+		return -1;
+	return 0;
+}
+
+void stack_fini(struct stack *stack)
+{
+	free(stack->pages);
+	free(stack->data);
+}
+
+// Translates the virtual page `vpage` into a physical page, using the cache if possible.
+static bool stack_translate(struct stack *stack, void *cpu, uint64_t asid, uint64_t vpage,
+		uint64_t *ppage)
+{
+	struct stack_tlb_entry *ent = &stack->tlb[(vpage / PAGE_SIZE) % STACK_TLB_SIZE];
+	if (ent->vpage != vpage || ent->asid != asid)
+	{
+		uint64_t phys = cpu_get_phys_page_debug(cpu, vpage);
+		if (phys == (uint64_t) -1)
+			return false;
+		ent->asid = asid;
+		ent->vpage = vpage;
+		ent->ppage = phys;
+	}
+	*ppage = ent->ppage;
+	return true;
+}
+
+// Returns the local copy of the byte at the virtual address `addr`, copying the part of the page
+// above it if necessary.
+//
+// If the page cannot be copied, the function returns `NULL`.
+static const uint8_t *stack_get(struct stack *stack, void *cpu, uint64_t asid, uint64_t addr)
+{
+	uint64_t vpage = addr & ~(uint64_t) (PAGE_SIZE - 1);
+	size_t off = addr & (PAGE_SIZE - 1);
+	size_t i;
+	for (i = 0; i < stack->pages_count; i++)
+		if (stack->pages[i].vpage == vpage)
+			break;
+	struct stack_page *page = &stack->pages[i];
+	uint8_t *data = stack->data + i * PAGE_SIZE;
+	if (i < stack->pages_count && off >= page->start)
+		return data + off;
+	// The page is not present, or only partially
+	bool present = i < stack->pages_count;
+	if (!present && stack->pages_count >= stack->pages_max)
+		return NULL;
+	uint64_t ppage;
+	if (!stack_translate(stack, cpu, asid, vpage, &ppage))
+		return NULL;
+	size_t end = present ? page->start : PAGE_SIZE;
+	cpu_physical_memory_rw(ppage + off, data + off, end - off, false);
+	page->vpage = vpage;
+	page->start = off;
+	if (!present)
+		stack->pages_count++;
+	return data + off;
+}
+
+bool stack_read(struct stack *stack, void *cpu, uint64_t asid, uint64_t addr, size_t len,
+		uint64_t *val)
+{
+	uint8_t buf[8];
+	size_t i = 0;
+	// The value may span two pages
+	while (i < len)
+	{
+		const uint8_t *src = stack_get(stack, cpu, asid, addr + i);
+		if (!src)
+			return false;
+		size_t n = PAGE_SIZE - ((addr + i) & (PAGE_SIZE - 1));
+		if (n > len - i)
+			n = len - i;
+		memcpy(buf + i, src, n);
+		i += n;
+	}
+	*val = 0;
+	memcpy(val, buf, len);
+	return true;
+}
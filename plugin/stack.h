@@ -0,0 +1,78 @@
+// Local copy of a guest stack
+//
+// Unwinding a stack requires reading two words per frame. Instead of asking QEMU for each of them,
+// which walks the guest page tables every time, the pages of the stack are copied once into host
+// memory, then frames are read from the copy.
+
+#ifndef STACK_H
+#define STACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The size of a guest page in bytes
+#define PAGE_SIZE		4096
+// The number of entries in the cache of stack pages translations
+#define STACK_TLB_SIZE	4
+
+// An entry of the cache of stack pages translations
+struct stack_tlb_entry
+{
+	// The address space (CR3) in which the translation is valid
+	uint64_t asid;
+	// The virtual address of the page. If not page-aligned, the entry is invalid
+	uint64_t vpage;
+	// The physical address of the page
+	uint64_t ppage;
+};
+
+// A guest page copied in host memory
+struct stack_page
+{
+	// The virtual address of the page
+	uint64_t vpage;
+	// The offset of the first byte of the page that has been copied. Since the stack grows
+	// downwards, only the part above the frame pointer is copied
+	size_t start;
+};
+
+// The stack of a vCPU. Only this vCPU accesses it
+struct stack
+{
+	// Cache of the translations of the last stack pages. The translation of a given stack page
+	// rarely changes, so it is kept from one sample to the next
+	struct stack_tlb_entry tlb[STACK_TLB_SIZE];
+
+	// The pages copied for the current sample
+	struct stack_page *pages;
+	// The number of elements in `pages`
+	size_t pages_count;
+	// The maximum number of pages that can be copied for a single sample
+	size_t pages_max;
+	// The content of the copied pages. Page `i` is at offset `i * PAGE_SIZE`
+	uint8_t *data;
+};
+
+// Initializes the stack, with a window of `window` bytes at most copied for each sample.
+//
+// On error, the function returns `-1` and sets `errno`.
+int stack_init(struct stack *stack, size_t window);
+// Frees the stack.
+void stack_fini(struct stack *stack);
+
+// Forgets the pages copied for the previous sample. This must be called before unwinding a new
+// sample.
+static inline void stack_reset(struct stack *stack)
+{
+	stack->pages_count = 0;
+}
+
+// Reads `len` bytes (at most 8) at the virtual address `addr` on the stack of `cpu`, in the address
+// space `asid`, and stores them in `val` (little-endian).
+//
+// If the memory cannot be read or exceeds the window, the function returns `false`.
+bool stack_read(struct stack *stack, void *cpu, uint64_t asid, uint64_t addr, size_t len,
+		uint64_t *val);
+
+#endif
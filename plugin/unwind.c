@@ -0,0 +1,80 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "unwind.h"
+
+_Static_assert(sizeof(struct unwind_entry) == 12, "unwind entries must match the file layout");
+
+int unwind_table_load(const char *path, struct unwind_table *table)
+{
+	memset(table, 0, sizeof(*table));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	const uint8_t *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		return -1;
+	// Check header
+	uint16_t version;
+	uint32_t count;
+	if (st.st_size < UNWIND_HEADER_SIZE || memcmp(buf, UNWIND_MAGIC, 4))
+		goto invalid;
+	memcpy(&version, buf + 4, sizeof(version));
+	memcpy(&count, buf + 8, sizeof(count));
+	if (version != UNWIND_VERSION
+			|| (size_t) st.st_size < UNWIND_HEADER_SIZE + count * sizeof(struct unwind_entry))
+		goto invalid;
+	table->ptr_width = buf[6];
+	memcpy(&table->base, buf + 16, sizeof(table->base));
+	table->entries = (const void *) (buf + UNWIND_HEADER_SIZE);
+	table->count = count;
+	table->map = (void *) buf;
+	table->map_len = st.st_size;
+	return 0;
+
+invalid:
+	munmap((void *) buf, st.st_size);
+	errno = EINVAL;
+	return -1;
+}
+
+void unwind_table_fini(struct unwind_table *table)
+{
+	if (table->map)
+		munmap(table->map, table->map_len);
+	memset(table, 0, sizeof(*table));
+}
+
+const struct unwind_entry *unwind_table_find(const struct unwind_table *table, uint64_t pc)
+{
+	if (pc < table->base || pc - table->base > UINT32_MAX)
+		return NULL;
+	uint32_t off = pc - table->base;
+	// Look for the last entry starting at or before `off`
+	size_t lo = 0, hi = table->count;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (table->entries[mid].pc <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	const struct unwind_entry *ent = &table->entries[lo - 1];
+	if (ent->cfa_reg == UNWIND_CFA_UNDEFINED)
+		return NULL;
+	return ent;
+}
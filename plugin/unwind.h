@@ -0,0 +1,86 @@
+// Unwind table, generated from the call frame information of the kernel by the aggregator
+// (`kern-profile --unwind-table`)
+//
+// It allows unwinding kernels built without frame pointers. The file contains:
+// - the magic number (`UNWIND_MAGIC`)
+// - the version (`u16`)
+// - the size of a pointer on the target in bytes (`u8`), then one byte of padding
+// - the number of entries (`u32`), then four bytes of padding
+// - the base address entries are relative to (`u64`)
+// - the entries (`struct unwind_entry`), sorted by address
+//
+// Each entry covers the addresses from its own to the one of the next entry. The last entry is
+// always undefined. All values are little-endian, like the host.
+
+#ifndef UNWIND_H
+#define UNWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The magic number at the beginning of the table
+#define UNWIND_MAGIC			"\x7f" "KPU"
+// The current version of the table
+#define UNWIND_VERSION			1
+// The size of the header of the table in bytes
+#define UNWIND_HEADER_SIZE		24
+
+// The CFA is unknown: unwinding stops there
+#define UNWIND_CFA_UNDEFINED	0
+// The CFA is relative to the stack pointer
+#define UNWIND_CFA_SP			1
+// The CFA is relative to the frame pointer
+#define UNWIND_CFA_BP			2
+
+// The frame pointer of the caller is the same as the one of the callee
+#define UNWIND_BP_SAME			0
+// The frame pointer of the caller is saved at `bp_off` from the CFA
+#define UNWIND_BP_AT_CFA		1
+
+// How to unwind the frames of functions executing at a range of addresses. The return address is
+// always right below the CFA (canonical frame address), which is the value of the stack pointer
+// before the call
+struct unwind_entry
+{
+	// The address of the beginning of the range, relative to the base of the table
+	uint32_t pc;
+	// The offset of the CFA from the register given by `cfa_reg`
+	int32_t cfa_off;
+	// The offset from the CFA at which the caller's frame pointer is saved (see `bp_rule`)
+	int16_t bp_off;
+	// The register the CFA is relative to (see `UNWIND_CFA_*`)
+	uint8_t cfa_reg;
+	// The location of the caller's frame pointer (see `UNWIND_BP_*`)
+	uint8_t bp_rule;
+};
+
+struct unwind_table
+{
+	// The size of a pointer on the target in bytes
+	uint8_t ptr_width;
+	// The address entries are relative to
+	uint64_t base;
+	// The entries
+	const struct unwind_entry *entries;
+	// The number of elements in `entries`. If zero, no table is loaded
+	size_t count;
+
+	// The mapping of the file
+	void *map;
+	// The size of `map` in bytes
+	size_t map_len;
+};
+
+// Loads the unwind table at `path`.
+//
+// On error, the function returns `-1` and sets `errno`.
+int unwind_table_load(const char *path, struct unwind_table *table);
+// Frees the table.
+void unwind_table_fini(struct unwind_table *table);
+
+// Returns the entry covering the address `pc`.
+//
+// If the address is not covered, or how to unwind it is unknown, the function returns `NULL`.
+const struct unwind_entry *unwind_table_find(const struct unwind_table *table, uint64_t pc);
+
+#endif
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "writer.h"
+
+// If a pass over the ring buffers wrote less than this amount of bytes, the writer thread sleeps
+// before the next one, so that writes are large
+#define WRITER_LOW_WATERMARK	(64 * 1024)
+// The amount of time the writer thread sleeps between passes, in nanoseconds
+#define WRITER_SLEEP_NS			1000000
+// When compressing, the size of the data after which a frame is compressed and written
+#define WRITER_FRAME_SIZE		(1024 * 1024)
+// When compressing, the maximum amount of time data waits in a frame before being written, in
+// nanoseconds, so that the output can be followed
+#define WRITER_FRAME_NS			100000000
+
+struct writer
+{
+	// The FD of the output file
+	int fd;
+	// The ring buffers
+	struct ring *rings;
+	// The number of elements in `rings`
+	size_t rings_count;
+
+	// The compressor of frames
+	struct compressor comp;
+	// With compression, the frame being filled with the content of ring buffers
+	uint8_t *frame;
+	// The size of the content of `frame` in bytes
+	size_t frame_len;
+	// The size of `frame` in bytes
+	size_t frame_size;
+	// The buffer frames are compressed into
+	uint8_t *compressed;
+	// The time the last frame has been written at
+	uint64_t frame_ts;
+	// The number of bytes of compressed frames written to the output file
+	uint64_t compressed_bytes;
+
+	// The writer thread
+	pthread_t thread;
+	// Tells the writer thread to stop after its next pass
+	atomic_bool stop;
+	// Tells whether an error has already been reported, to avoid flooding the output
+	bool error_reported;
+};
+
+static struct writer writer;
+
+int write_all(int fd, struct iovec *v, int count)
+{
+	while (count > 0)
+	{
+		ssize_t len = writev(fd, v, count);
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		// Skip what has been written
+		while (count > 0 && (size_t) len >= v->iov_len)
+		{
+			len -= v->iov_len;
+			v++;
+			count--;
+		}
+		if (count > 0)
+		{
+			v->iov_base = (uint8_t *) v->iov_base + len;
+			v->iov_len -= len;
+		}
+	}
+	return 0;
+}
+
+// Reports an error writing the output file, once.
+static void writer_error(const char *msg)
+{
+	if (!writer.error_reported)
+	{
+		dprintf(STDERR_FILENO, "warning: %s: %s\n", msg, strerror(errno));
+		writer.error_reported = true;
+	}
+}
+
+static uint64_t writer_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Compresses the frame and writes it to the output file, then empties it.
+static void frame_flush(void)
+{
+	writer.frame_ts = writer_now_ns();
+	if (!writer.frame_len)
+		return;
+	struct iovec v;
+	v.iov_base = compress_frame(&writer.comp, writer.compressed, writer.frame, writer.frame_len,
+			&v.iov_len);
+	// On error, the data is discarded like when writing uncompressed data
+	if (!v.iov_base)
+	{
+		errno = EINVAL;
+		writer_error("could not compress output");
+	}
+	else if (write_all(writer.fd, &v, 1) < 0)
+		writer_error("could not write to output file");
+	else
+		writer.compressed_bytes += v.iov_len;
+	writer.frame_len = 0;
+}
+
+// Writes everything available in the ring buffer to the output file, or to the frame when
+// compressing. The function returns the number of bytes consumed.
+static size_t ring_drain(struct ring *ring)
+{
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size_t len = head - tail;
+	if (len == 0)
+		return 0;
+	// The data may wrap around the end of the buffer
+	size_t off = tail & (ring->size - 1);
+	size_t first = ring->size - off < len ? ring->size - off : len;
+	struct iovec v[2] = {
+		{ .iov_base = ring->buf + off, .iov_len = first },
+		{ .iov_base = ring->buf, .iov_len = len - first },
+	};
+	if (writer.comp.algo != COMPRESS_NONE)
+	{
+		// Ring buffers only contain whole blocks, which must not be split across frames. The
+		// frame is at least as large as a ring buffer, so the data fits once it is flushed
+		if (writer.frame_len + len > writer.frame_size)
+			frame_flush();
+		for (int i = 0; i < 2; i++)
+		{
+			memcpy(writer.frame + writer.frame_len, v[i].iov_base, v[i].iov_len);
+			writer.frame_len += v[i].iov_len;
+		}
+	}
+	// On error, the data is discarded so that vCPUs can keep going
+	else if (write_all(writer.fd, v, len > first ? 2 : 1) < 0)
+		writer_error("could not write to output file");
+	atomic_store_explicit(&ring->tail, head, memory_order_release);
+	return len;
+}
+
+static void *writer_main(void *arg)
+{
+	while (true)
+	{
+		bool stop = atomic_load(&writer.stop);
+		size_t written = 0;
+		for (size_t i = 0; i < writer.rings_count; i++)
+			written += ring_drain(&writer.rings[i]);
+		if (writer.comp.algo != COMPRESS_NONE && (stop || writer.frame_len >= WRITER_FRAME_SIZE
+				|| writer_now_ns() - writer.frame_ts >= WRITER_FRAME_NS))
+			frame_flush();
+		if (stop)
+			break;
+		if (written < WRITER_LOW_WATERMARK)
+		{
+			struct timespec ts = { .tv_sec = 0, .tv_nsec = WRITER_SLEEP_NS };
+			nanosleep(&ts, NULL);
+		}
+	}
+	return NULL;
+}
+
+int writer_init(int fd, size_t count, size_t size, enum compress_algo algo)
+{
+	writer.fd = fd;
+	if (compressor_init(&writer.comp, algo) < 0)
+		return -1;
+	if (algo != COMPRESS_NONE)
+	{
+		writer.frame_size = size > WRITER_FRAME_SIZE ? size : WRITER_FRAME_SIZE;
+		writer.frame = malloc(writer.frame_size);
+		writer.compressed = malloc(compress_bound(&writer.comp, writer.frame_size));
+		if (!writer.frame || !writer.compressed)
+			return -1;
+		writer.frame_ts = writer_now_ns();
+	}
+	writer.rings = aligned_alloc(64, count * sizeof(struct ring));
+	if (!writer.rings)
+		return -1;
+	memset(writer.rings, 0, count * sizeof(struct ring));
+	writer.rings_count = count;
+	for (size_t i = 0; i < count; i++)
+	{
+		writer.rings[i].size = size;
+		writer.rings[i].buf = malloc(size);
+		if (!writer.rings[i].buf)
+			return -1;
+	}
+	int err = pthread_create(&writer.thread, NULL, writer_main, NULL);
+	if (err)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+struct ring *writer_ring(size_t index)
+{
+	return &writer.rings[index];
+}
+
+void writer_fini(void)
+{
+	atomic_store(&writer.stop, true);
+	pthread_join(writer.thread, NULL);
+	for (size_t i = 0; i < writer.rings_count; i++)
+		free(writer.rings[i].buf);
+	free(writer.rings);
+	free(writer.frame);
+	free(writer.compressed);
+	compressor_fini(&writer.comp);
+}
+
+uint64_t writer_compressed_bytes(void)
+{
+	return writer.compressed_bytes;
+}
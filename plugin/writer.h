@@ -0,0 +1,77 @@
+// Asynchronous writer for the output file
+//
+// Each vCPU pushes its records into its own ring buffer. A background thread drains all the ring
+// buffers to the output file, so that the vCPU threads never wait for disk I/O. It also compresses
+// the output if requested, off the vCPU threads.
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "compress.h"
+
+// Single-producer single-consumer ring buffer. The producer is a vCPU thread, the consumer is the
+// writer thread
+//
+// `head` and `tail` are never wrapped around. The position in `buf` is obtained by masking them
+// with `size - 1`.
+struct ring
+{
+	// The position of the next byte to be written by the producer
+	_Atomic uint64_t head;
+
+	// The position of the next byte to be read by the consumer
+	_Atomic uint64_t tail __attribute__((aligned(64)));
+
+	// The size of the buffer in bytes. This is a power of two
+	size_t size __attribute__((aligned(64)));
+	// The buffer
+	uint8_t *buf;
+} __attribute__((aligned(64)));
+
+// Pushes the data `rec` of `len` bytes on the ring buffer.
+//
+// If there is not enough space left in the buffer, the data is dropped and the function returns
+// `false`.
+static inline bool ring_push(struct ring *ring, const void *rec, size_t len)
+{
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (ring->size - (head - tail) < len)
+		return false;
+	size_t off = head & (ring->size - 1);
+	size_t first = ring->size - off < len ? ring->size - off : len;
+	memcpy(ring->buf + off, rec, first);
+	memcpy(ring->buf, (const uint8_t *) rec + first, len - first);
+	atomic_store_explicit(&ring->head, head + len, memory_order_release);
+	return true;
+}
+
+// Writes the given buffers to the file `fd`, retrying until everything is written.
+//
+// On error, the function returns `-1` and sets `errno`.
+int write_all(int fd, struct iovec *v, int count);
+
+// Allocates `count` ring buffers of `size` bytes and starts the writer thread, which writes their
+// content to the file `fd`, compressed with `algo`.
+//
+// `size` must be a power of two.
+//
+// On error, the function returns `-1` and sets `errno`.
+int writer_init(int fd, size_t count, size_t size, enum compress_algo algo);
+// Returns the ring buffer with the given index.
+struct ring *writer_ring(size_t index);
+// Stops the writer thread after it has written everything left in the ring buffers, then frees
+// them.
+void writer_fini(void);
+// Returns the number of bytes of compressed frames written to the output file, or `0` if the
+// output is not compressed. This must be called once the writer thread has been stopped.
+uint64_t writer_compressed_bytes(void);
+
+#endif
@@ -0,0 +1,99 @@
+//! Decompression of the frames of compressed profiles (see [`format::BLOCK_ZSTD`] and
+//! [`format::BLOCK_LZ4`]).
+//!
+//! Each frame is compressed on its own and holds whole blocks, so frames are decompressed on the
+//! threads folding them.
+
+use crate::format;
+use crate::format::Input;
+use std::io;
+use std::io::Read;
+
+/// The maximum ratio between the sizes of LZ4 data once decompressed and compressed: each byte
+/// extending a length adds at most 255 bytes.
+const LZ4_MAX_RATIO: usize = 255;
+/// The maximum ratio between the sizes of a zstd frame once decompressed and compressed: a block
+/// of 128 KiB repeating a single byte is encoded in 4 bytes.
+const ZSTD_MAX_RATIO: usize = 32 * 1024;
+
+/// Decompresses the payload of a block with the tag `tag`, whose decompressed size is `size`.
+///
+/// `size` is read from the file, so it is checked against what the payload can expand to before
+/// anything is allocated.
+pub fn decompress(tag: u8, size: usize, payload: &[u8]) -> io::Result<Vec<u8>> {
+    let max_ratio = match tag {
+        format::BLOCK_ZSTD => ZSTD_MAX_RATIO,
+        format::BLOCK_LZ4 => LZ4_MAX_RATIO,
+        _ => return Err(format::invalid_data(format!("invalid block tag `{tag}`"))),
+    };
+    if size > payload.len().saturating_mul(max_ratio) {
+        return Err(format::invalid_data("invalid size of compressed block"));
+    }
+    let data = match tag {
+        format::BLOCK_ZSTD => zstd_decompress(payload, size)?,
+        _ => lz4_decompress(payload, size)?,
+    };
+    if data.len() != size {
+        return Err(format::invalid_data("invalid size of compressed block"));
+    }
+    Ok(data)
+}
+
+/// Decompresses a zstd frame, of at most `size` bytes once decompressed.
+///
+/// The frame may expand to much more than its own size, so the output grows as the frame is
+/// decompressed instead of being allocated upfront, in case `size` is corrupted.
+fn zstd_decompress(data: &[u8], size: usize) -> io::Result<Vec<u8>> {
+    let mut out = Vec::new();
+    zstd::stream::read::Decoder::with_buffer(data)?
+        .take(size as u64 + 1)
+        .read_to_end(&mut out)?;
+    Ok(out)
+}
+
+/// Reads the extension of a length of the LZ4 block format: bytes are added until one is not
+/// `255`.
+fn lz4_length(input: &mut Input, mut len: usize) -> io::Result<usize> {
+    if len == 15 {
+        loop {
+            let byte = input.u8()?;
+            len += byte as usize;
+            if byte != 255 {
+                break;
+            }
+        }
+    }
+    Ok(len)
+}
+
+/// Decompresses data in the LZ4 block format, of at most `size` bytes once decompressed.
+///
+/// The data is a sequence of literals, each followed by a match copying bytes already
+/// decompressed, except for the last sequence.
+fn lz4_decompress(data: &[u8], size: usize) -> io::Result<Vec<u8>> {
+    let invalid = || format::invalid_data("invalid LZ4 block");
+    let mut input = Input::new(data);
+    let mut out = Vec::with_capacity(size);
+    while !input.is_empty() {
+        let token = input.u8()?;
+        let literals = lz4_length(&mut input, (token >> 4) as usize)?;
+        if out.len() + literals > size {
+            return Err(invalid());
+        }
+        out.extend_from_slice(input.bytes(literals)?);
+        if input.is_empty() {
+            break;
+        }
+        let offset = u16::from_le_bytes(input.bytes(2)?.try_into().unwrap()) as usize;
+        let len = lz4_length(&mut input, (token & 0xf) as usize)? + 4;
+        if offset == 0 || offset > out.len() || out.len() + len > size {
+            return Err(invalid());
+        }
+        // The match may overlap the bytes it produces
+        let start = out.len() - offset;
+        for i in start..start + len {
+            out.push(out[i]);
+        }
+    }
+    Ok(out)
+}
@@ -0,0 +1,129 @@
+//! Comparison of two CPU profiles: a baseline and a new one.
+//!
+//! Counts are normalized by the total number of samples of each profile, so that profiles of
+//! different lengths can be compared. The differential FlameGraph is the one of the new profile,
+//! each frame being colored according to how its share of samples changed since the baseline.
+//! Stacks that only appear in the baseline have no width, so they only show up in the report.
+
+use crate::tree::{CallTree, FrameNames, ROOT};
+use std::collections::HashMap;
+use std::io;
+use std::io::Write;
+
+/// The number of functions listed in the report.
+pub const REPORT_LEN: usize = 30;
+
+/// Returns, for each node of `new`, the difference between its share of samples in `new` and
+/// the share of the same stack in `base`, in percents.
+pub fn node_deltas(base: &CallTree, new: &CallTree) -> Vec<f64> {
+    let base_totals = base.totals();
+    let new_totals = new.totals();
+    let share = |totals: &[u64], node: u32| {
+        let total = totals[ROOT as usize];
+        if total == 0 {
+            return 0.0;
+        }
+        totals[node as usize] as f64 * 100.0 / total as f64
+    };
+    let mut deltas = vec![0.0; new_totals.len()];
+    // Both trees are walked at once. A node of `new` may not exist in `base`
+    let mut stack = vec![(ROOT, Some(ROOT))];
+    while let Some((node, base_node)) = stack.pop() {
+        let base_share = base_node.map_or(0.0, |n| share(&base_totals, n));
+        deltas[node as usize] = share(&new_totals, node) - base_share;
+        for child in new.children(node) {
+            let base_child = base_node.and_then(|n| base.child(n, new.frame(child)));
+            stack.push((child, base_child));
+        }
+    }
+    deltas
+}
+
+/// Returns the self share of samples of each function in the given tree, in percents: the
+/// samples collected while the function itself was executing, not one of its callees.
+fn self_shares(tree: &CallTree) -> HashMap<u32, f64> {
+    let mut counts: HashMap<u32, u64> = HashMap::new();
+    let _ = tree.for_each_stack(|frames, count| {
+        *counts.entry(*frames.last().unwrap()).or_insert(0) += count;
+        Ok(())
+    });
+    let total: u64 = counts.values().sum();
+    counts
+        .into_iter()
+        .map(|(frame, count)| (frame, count as f64 * 100.0 / total as f64))
+        .collect()
+}
+
+/// Writes the functions whose self share of samples changed the most between `base` and `new`,
+/// from the largest change to the smallest.
+pub fn write_report<W: Write>(
+    base: &CallTree,
+    new: &CallTree,
+    names: &FrameNames,
+    out: &mut W,
+) -> io::Result<()> {
+    let base_shares = self_shares(base);
+    let mut new_shares = self_shares(new);
+    let mut changes: Vec<(u32, f64, f64)> = base_shares
+        .iter()
+        .map(|(frame, share)| (*frame, *share, new_shares.remove(frame).unwrap_or(0.0)))
+        .collect();
+    changes.extend(new_shares.into_iter().map(|(frame, share)| (frame, 0.0, share)));
+    // Ties are sorted by name, so that the report is stable
+    changes.sort_unstable_by(|(f1, b1, n1), (f2, b2, n2)| {
+        (n2 - b2)
+            .abs()
+            .total_cmp(&(n1 - b1).abs())
+            .then_with(|| names.get(*f1).cmp(names.get(*f2)))
+    });
+    writeln!(out, "{:>9} {:>9} {:>9}  function", "change", "base", "new")?;
+    for (frame, base, new) in changes.into_iter().take(REPORT_LEN) {
+        writeln!(
+            out,
+            "{:>+8.2}% {base:>8.2}% {new:>8.2}%  {}",
+            new - base,
+            names.get(frame)
+        )?;
+    }
+    Ok(())
+}
+
+/// Writes the stacks of both profiles in the differential folded format accepted by
+/// `flamegraph.pl`: one line per stack, with frames separated by `;`, followed by the number of
+/// occurrences in `base` and in `new`. Counts of `base` are scaled to the total of `new`.
+pub fn write_folded<W: Write>(
+    base: &CallTree,
+    new: &CallTree,
+    names: &FrameNames,
+    out: &mut W,
+) -> io::Result<()> {
+    let base_total = base.totals()[ROOT as usize];
+    let new_total = new.totals()[ROOT as usize];
+    let scale = if base_total == 0 {
+        0.0
+    } else {
+        new_total as f64 / base_total as f64
+    };
+    let mut base_stacks: HashMap<Vec<u32>, u64> = HashMap::new();
+    base.for_each_stack(|frames, count| {
+        base_stacks.insert(frames.to_vec(), count);
+        Ok(())
+    })?;
+    let mut write_stack = |frames: &[u32], base: u64, new: u64| {
+        for (i, frame) in frames.iter().enumerate() {
+            if i > 0 {
+                out.write_all(b";")?;
+            }
+            out.write_all(names.get(*frame).as_bytes())?;
+        }
+        writeln!(out, " {} {new}", (base as f64 * scale).round() as u64)
+    };
+    new.for_each_stack(|frames, count| {
+        let base = base_stacks.remove(frames).unwrap_or(0);
+        write_stack(frames, base, count)
+    })?;
+    for (frames, count) in base_stacks {
+        write_stack(&frames, count, 0)?;
+    }
+    Ok(())
+}
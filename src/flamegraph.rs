@@ -0,0 +1,266 @@
+//! Rendering of call trees as FlameGraphs in SVG, in the style of `flamegraph.pl`.
+//!
+//! Each frame is drawn as a rectangle whose width is proportional to the number of occurrences of
+//! the stacks going through it, on top of the frame calling it. Siblings are sorted by name, and
+//! hovering a frame shows its name and count.
+
+use crate::tree::{CallTree, FrameNames, ROOT};
+use std::io;
+use std::io::Write;
+
+/// The width of the image, in pixels.
+const IMAGE_WIDTH: f64 = 1200.0;
+/// The height of a frame, in pixels.
+const FRAME_HEIGHT: f64 = 16.0;
+/// The horizontal padding of the image, in pixels.
+const X_PAD: f64 = 10.0;
+/// The vertical padding above frames (to leave room for the title), in pixels.
+const Y_PAD_TOP: f64 = FONT_SIZE * 3.0;
+/// The vertical padding below frames, in pixels.
+const Y_PAD_BOTTOM: f64 = FONT_SIZE * 2.0 + 10.0;
+/// The font size, in pixels.
+const FONT_SIZE: f64 = 12.0;
+/// The average width of a character, relative to the font size.
+const FONT_WIDTH: f64 = 0.59;
+/// Frames narrower than this, in pixels, are not drawn, and neither are their descendants.
+const MIN_WIDTH: f64 = 0.1;
+
+/// The colors of a FlameGraph.
+#[derive(Clone, Copy)]
+pub enum Palette {
+    /// Red to yellow, for CPU time.
+    Hot,
+    /// Green to blue, for memory (same as `--colors mem` with `flamegraph.pl`).
+    Mem,
+}
+
+impl Palette {
+    /// Returns the two colors of the background gradient, from top to bottom.
+    fn background(self) -> (&'static str, &'static str) {
+        match self {
+            Self::Hot => ("#eeeeee", "#eeeeb0"),
+            Self::Mem => ("#eeeeee", "#e0e0ff"),
+        }
+    }
+
+    /// Returns the color of the frame with the given name.
+    ///
+    /// The color is derived from a hash of the name, so that a function has the same color in
+    /// every graph.
+    fn color(self, name: &str) -> (u8, u8, u8) {
+        // FNV-1a
+        let hash = name
+            .bytes()
+            .fold(0xcbf29ce484222325u64, |h, b| (h ^ b as u64).wrapping_mul(0x100000001b3));
+        let v = |i: u32| ((hash >> (i * 16)) & 0xffff) as f64 / 65536.0;
+        let (v1, v2, v3) = (v(0), v(1), v(2));
+        match self {
+            Self::Hot => (
+                (205.0 + 50.0 * v3) as u8,
+                (230.0 * v1) as u8,
+                (55.0 * v2) as u8,
+            ),
+            Self::Mem => (0, (190.0 + 50.0 * v2) as u8, (210.0 * v1) as u8),
+        }
+    }
+}
+
+/// Options of a FlameGraph.
+pub struct Options<'a> {
+    /// The title, written on top of the graph.
+    pub title: &'a str,
+    /// The name of the counted unit, shown along counts (for example, `samples` or `bytes`).
+    pub count_name: &'a str,
+    /// The colors of the graph.
+    pub palette: Palette,
+    /// For a differential graph, the change of the share of samples of each node since the
+    /// baseline, in percents (see [`crate::diff`]). Frames are then colored red if their share
+    /// grew and blue if it shrank, instead of using the palette.
+    pub deltas: Option<&'a [f64]>,
+}
+
+/// Returns the color of a frame of a differential graph, given its change and the largest change
+/// of the graph, in absolute value.
+fn diff_color(delta: f64, max_delta: f64) -> (u8, u8, u8) {
+    if delta == 0.0 || max_delta == 0.0 {
+        return (250, 250, 250);
+    }
+    let v = (210.0 * (1.0 - delta.abs() / max_delta)) as u8;
+    if delta > 0.0 {
+        (255, v, v)
+    } else {
+        (v, v, 255)
+    }
+}
+
+/// A frame to be drawn.
+struct Rect {
+    /// The node of the call tree.
+    node: u32,
+    /// The depth of the node, the root being at depth zero.
+    depth: u32,
+    /// The horizontal position of the left side, in pixels.
+    x: f64,
+    /// The width, in pixels.
+    width: f64,
+}
+
+/// Writes the given text, escaping XML special characters.
+fn write_escaped<W: Write>(out: &mut W, text: &str) -> io::Result<()> {
+    let mut rest = text;
+    while let Some(i) = rest.find(['&', '<', '>', '"']) {
+        out.write_all(rest[..i].as_bytes())?;
+        let escaped = match rest.as_bytes()[i] {
+            b'&' => "&amp;",
+            b'<' => "&lt;",
+            b'>' => "&gt;",
+            _ => "&quot;",
+        };
+        out.write_all(escaped.as_bytes())?;
+        rest = &rest[i + 1..];
+    }
+    out.write_all(rest.as_bytes())
+}
+
+/// Lays out the frames of the tree. Frames that are too narrow to be seen are omitted.
+fn layout(tree: &CallTree, names: &FrameNames, totals: &[u64]) -> Vec<Rect> {
+    let total = totals[ROOT as usize];
+    if total == 0 {
+        return vec![];
+    }
+    let scale = (IMAGE_WIDTH - 2.0 * X_PAD) / total as f64;
+    let mut rects = Vec::new();
+    let mut children = Vec::new();
+    let mut stack = vec![(ROOT, 0, X_PAD)];
+    while let Some((node, depth, x)) = stack.pop() {
+        let width = totals[node as usize] as f64 * scale;
+        if width < MIN_WIDTH {
+            continue;
+        }
+        rects.push(Rect {
+            node,
+            depth,
+            x,
+            width,
+        });
+        // Children are laid out from left to right, sorted by name
+        children.clear();
+        children.extend(tree.children(node));
+        children.sort_unstable_by_key(|c| names.get(tree.frame(*c)));
+        let mut child_x = x;
+        for child in &children {
+            stack.push((*child, depth + 1, child_x));
+            child_x += totals[*child as usize] as f64 * scale;
+        }
+    }
+    rects
+}
+
+/// Writes the FlameGraph of the given tree in SVG.
+pub fn write_svg<W: Write>(
+    tree: &CallTree,
+    names: &FrameNames,
+    options: &Options,
+    out: &mut W,
+) -> io::Result<()> {
+    let totals = tree.totals();
+    let total = totals[ROOT as usize];
+    let rects = layout(tree, names, &totals);
+    let max_depth = rects.iter().map(|r| r.depth).max().unwrap_or(0);
+    let height = (max_depth + 1) as f64 * FRAME_HEIGHT + Y_PAD_TOP + Y_PAD_BOTTOM;
+    let (bg_top, bg_bottom) = options.palette.background();
+    let max_delta = options.deltas.map_or(0.0, |deltas| {
+        rects
+            .iter()
+            .filter(|r| r.node != ROOT)
+            .map(|r| deltas[r.node as usize].abs())
+            .fold(0.0, f64::max)
+    });
+
+    writeln!(out, r#"<?xml version="1.0" standalone="no"?>"#)?;
+    writeln!(
+        out,
+        r#"<svg version="1.1" width="{IMAGE_WIDTH}" height="{height}" viewBox="0 0 {IMAGE_WIDTH} {height}" xmlns="http://www.w3.org/2000/svg">"#
+    )?;
+    writeln!(
+        out,
+        "<style>text {{ font-family: Verdana; font-size: {FONT_SIZE}px; fill: rgb(0, 0, 0); }} g:hover rect {{ stroke: black; stroke-width: 0.5; }}</style>"
+    )?;
+    writeln!(
+        out,
+        r#"<defs><linearGradient id="background" y1="0" y2="1" x1="0" x2="0"><stop stop-color="{bg_top}" offset="5%"/><stop stop-color="{bg_bottom}" offset="95%"/></linearGradient></defs>"#
+    )?;
+    writeln!(
+        out,
+        r#"<rect x="0" y="0" width="{IMAGE_WIDTH}" height="{height}" fill="url(#background)"/>"#
+    )?;
+    write!(
+        out,
+        r#"<text x="{}" y="{}" text-anchor="middle" style="font-size: {}px">"#,
+        IMAGE_WIDTH / 2.0,
+        FONT_SIZE * 2.0,
+        FONT_SIZE + 5.0
+    )?;
+    write_escaped(out, options.title)?;
+    writeln!(out, "</text>")?;
+    if total == 0 {
+        writeln!(
+            out,
+            r#"<text x="{}" y="{}" text-anchor="middle">No {}</text>"#,
+            IMAGE_WIDTH / 2.0,
+            Y_PAD_TOP + FRAME_HEIGHT,
+            options.count_name
+        )?;
+    }
+
+    for rect in &rects {
+        let name = match rect.node {
+            ROOT => "all",
+            node => names.get(tree.frame(node)),
+        };
+        let count = totals[rect.node as usize];
+        let percent = count as f64 * 100.0 / total as f64;
+        let y = height - Y_PAD_BOTTOM - (rect.depth + 1) as f64 * FRAME_HEIGHT;
+        let delta = options.deltas.map(|deltas| deltas[rect.node as usize]);
+        let (r, g, b) = match delta {
+            Some(delta) => diff_color(delta, max_delta),
+            None => options.palette.color(name),
+        };
+        // Tooltip
+        write!(out, "<g><title>")?;
+        write_escaped(out, name)?;
+        write!(out, " ({count} {}, {percent:.2}%", options.count_name)?;
+        if let Some(delta) = delta {
+            write!(out, ", {delta:+.2}%")?;
+        }
+        writeln!(out, ")</title>")?;
+        writeln!(
+            out,
+            r#"<rect x="{:.1}" y="{y:.1}" width="{:.1}" height="{:.1}" fill="rgb({r}, {g}, {b})" rx="2" ry="2"/>"#,
+            rect.x,
+            rect.width,
+            FRAME_HEIGHT - 1.0
+        )?;
+        // Label, truncated to fit in the frame
+        let fit = (rect.width / (FONT_SIZE * FONT_WIDTH)) as usize;
+        if fit >= 3 {
+            write!(
+                out,
+                r#"<text x="{:.1}" y="{:.1}">"#,
+                rect.x + 3.0,
+                y + FRAME_HEIGHT / 2.0 + FONT_SIZE / 3.0
+            )?;
+            if name.chars().count() <= fit {
+                write_escaped(out, name)?;
+            } else {
+                let end = name.char_indices().nth(fit - 2).map_or(name.len(), |(i, _)| i);
+                write_escaped(out, &name[..end])?;
+                out.write_all(b"..")?;
+            }
+            writeln!(out, "</text>")?;
+        }
+        writeln!(out, "</g>")?;
+    }
+
+    writeln!(out, "</svg>")
+}
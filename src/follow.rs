@@ -0,0 +1,145 @@
+//! Folding of a CPU profile while the plugin is still writing it.
+//!
+//! The profile is read as it grows. Whole blocks are folded as soon as they are available, and
+//! the incomplete tail is kept until the rest of it has been written.
+
+use crate::format::{Header, Input};
+use crate::tree::CallTree;
+use crate::{
+    add_cpu_stacks, check_header, complete_cpu_data, cpu_graph_prefix, fold_chunk_cpu,
+    fold_chunk_cpu_legacy, format, write_graph, GraphOutput, Resolver, Window,
+};
+use std::collections::HashMap;
+use std::fs;
+use std::fs::File;
+use std::io;
+use std::io::Read;
+use std::os::unix::fs::FileTypeExt;
+use std::path::Path;
+use std::thread;
+use std::time::{Duration, Instant};
+
+/// The maximum amount of bytes read at once.
+const READ_SIZE: usize = 1 << 20;
+/// The delay before reading again when no new data is available.
+const POLL_DELAY: Duration = Duration::from_millis(100);
+
+/// Options of CPU graphs.
+pub struct GraphOptions<'a> {
+    /// The build ID of the kernel, to be checked against the profile's.
+    pub elf_build_id: Option<&'a [u8]>,
+    /// Tells whether samples must be tagged with their address space.
+    pub address_spaces: bool,
+    /// Tells whether one graph is written for each vCPU.
+    pub per_cpu: bool,
+    /// The selection of samples.
+    pub window: &'a Window,
+    /// The format of graphs.
+    pub output: GraphOutput<'a>,
+}
+
+/// Writes all the graphs. Each one is written to a temporary file first, then renamed, so that
+/// a graph being refreshed is never seen partially written.
+fn write_graphs(
+    graphs: &HashMap<String, CallTree>,
+    resolver: &Resolver,
+    output: GraphOutput,
+) -> io::Result<()> {
+    for (name, tree) in graphs {
+        let title = name.strip_suffix(".svg").unwrap_or(name);
+        let path = Path::new(name).with_extension(output.extension());
+        let mut tmp = path.clone().into_os_string();
+        tmp.push(".tmp");
+        write_graph(Path::new(&tmp), title, tree, &resolver.names, false, "samples", output)?;
+        fs::rename(&tmp, path)?;
+    }
+    Ok(())
+}
+
+/// Folds the CPU profile at `path` as it is being written, refreshing graphs every `interval`.
+///
+/// `path` may be a regular file, which is followed until the command is interrupted, or a FIFO,
+/// which is followed until the plugin closes it.
+pub fn follow(
+    path: &Path,
+    interval: Duration,
+    options: &GraphOptions,
+    resolver: &mut Resolver,
+) -> io::Result<()> {
+    let mut file = File::open(path)?;
+    let fifo = file.metadata()?.file_type().is_fifo();
+    // Data that has been read but not folded yet
+    let mut buf = Vec::new();
+    // The header of the profile, once read. `Some(None)` for files in the legacy format
+    let mut header: Option<Option<Header>> = None;
+    let mut graphs = HashMap::new();
+    let mut dirty = true;
+    let mut last_write: Option<Instant> = None;
+    loop {
+        let len = buf.len();
+        buf.resize(len + READ_SIZE, 0);
+        let read = match file.read(&mut buf[len..]) {
+            Ok(n) => n,
+            Err(e) if e.kind() == io::ErrorKind::Interrupted => 0,
+            Err(e) => return Err(e),
+        };
+        buf.truncate(len + read);
+        let eof = read == 0;
+
+        // The header may not be complete yet
+        if header.is_none() && !buf.is_empty() {
+            let mut input = Input::new(&buf);
+            match format::read_header(&mut input) {
+                Ok(h) => {
+                    check_header(
+                        h.as_ref(),
+                        options.elf_build_id,
+                        options.window,
+                        options.address_spaces,
+                    );
+                    let len = buf.len() - input.remaining().len();
+                    buf.drain(..len);
+                    resolver.set_profile(h.as_ref());
+                    header = Some(h);
+                }
+                Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => {}
+                Err(e) => return Err(e),
+            }
+        }
+        if let Some(h) = &header {
+            let len = complete_cpu_data(&buf, h.is_none())?;
+            if len > 0 {
+                let input = Input::new(&buf[..len]);
+                let cpus = match h {
+                    Some(h) => fold_chunk_cpu(input, h, options.window)?,
+                    None => fold_chunk_cpu_legacy(input)?,
+                };
+                let prefix = cpu_graph_prefix(h.as_ref());
+                add_cpu_stacks(&mut graphs, cpus, prefix, options.per_cpu, options.window, resolver);
+                buf.drain(..len);
+                dirty = true;
+            }
+        }
+
+        let done = eof && fifo;
+        let due = last_write.map_or(true, |t| t.elapsed() >= interval);
+        if dirty && (due || done) {
+            // Nothing may have been folded yet, in which case an empty graph is written
+            let prefix = cpu_graph_prefix(header.as_ref().and_then(Option::as_ref));
+            let cpus = HashMap::new();
+            add_cpu_stacks(&mut graphs, cpus, prefix, options.per_cpu, options.window, resolver);
+            write_graphs(&graphs, resolver, options.output)?;
+            dirty = false;
+            last_write = Some(Instant::now());
+        }
+        if done {
+            if !buf.is_empty() {
+                return Err(format::truncated());
+            }
+            return Ok(());
+        }
+        if eof {
+            thread::sleep(POLL_DELAY);
+        }
+    }
+}
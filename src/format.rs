@@ -0,0 +1,261 @@
+//! Decoding of the profile files written by the QEMU plugin.
+//!
+//! A file either begins with a [`Header`] followed by blocks of records, or is in the legacy
+//! format: a sequence of records with raw `u64` frames, without header.
+//!
+//! The layout of the current format is described in `plugin/format.h`.
+
+use std::io;
+use std::mem::size_of;
+
+/// The magic number at the beginning of files with a header.
+pub const MAGIC: [u8; 4] = *b"\x7fKPF";
+/// The latest supported version of the format.
+pub const VERSION: u16 = 1;
+/// The size of the fixed part of the header, in bytes.
+const HEADER_SIZE: usize = 32;
+
+/// Header flag: records contain the number of occurrences of the stack.
+pub const FLAG_AGGREGATED: u8 = 1 << 0;
+/// Header flag: records contain a timestamp, relative to the previous record of the block.
+pub const FLAG_TIMESTAMPS: u8 = 1 << 1;
+/// Header flag: records contain the tag of their address space (the value of CR3 without its
+/// flags), relative to the previous record of the block.
+pub const FLAG_ADDRESS_SPACES: u8 = 1 << 2;
+/// Header flag: the file ends with the counters of the plugin for each vCPU (see [`Stats`]).
+pub const FLAG_STATS: u8 = 1 << 3;
+/// Header flag: records contain the frames where interrupts or exceptions were taken, as a bitmask
+/// of frame indices.
+pub const FLAG_CONTEXTS: u8 = 1 << 4;
+/// All the header flags supported by this version of the aggregator.
+const KNOWN_FLAGS: u8 =
+    FLAG_AGGREGATED | FLAG_TIMESTAMPS | FLAG_ADDRESS_SPACES | FLAG_STATS | FLAG_CONTEXTS;
+
+/// Tag of a block of stack samples.
+pub const BLOCK_SAMPLES: u8 = 1;
+/// Tag of a block of counters of a vCPU (see [`Stats`]).
+pub const BLOCK_STATS: u8 = 2;
+/// Tag of a block of blocks compressed as a zstd frame. The header of the block holds the size of
+/// the decompressed payload instead of a vCPU ID.
+pub const BLOCK_ZSTD: u8 = 3;
+/// Same as [`BLOCK_ZSTD`], in the LZ4 block format.
+pub const BLOCK_LZ4: u8 = 4;
+
+/// The way samples have been collected.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+pub enum SampleMode {
+    /// Every `sample_interval` nanoseconds.
+    Time,
+    /// Every `sample_interval` guest instructions.
+    Instructions,
+    /// Every `sample_interval` guest memory accesses, attributed to the instruction making the
+    /// access.
+    Accesses,
+}
+
+/// The header of a profile file.
+#[allow(dead_code)]
+#[derive(Debug)]
+pub struct Header {
+    /// The version of the format.
+    pub version: u16,
+    /// The size of a pointer on the target, in bytes.
+    pub ptr_width: u8,
+    /// Flags (see `FLAG_*`).
+    pub flags: u8,
+    /// The way samples have been collected.
+    pub sample_mode: SampleMode,
+    /// The number of vCPUs.
+    pub vcpus: u32,
+    /// The interval between samples, whose unit depends on `sample_mode`.
+    pub sample_interval: u64,
+    /// The address frames are encoded relatively to.
+    pub base: u64,
+    /// The build ID of the observed kernel, if known.
+    pub build_id: Option<Vec<u8>>,
+}
+
+/// Counters of the plugin for a vCPU.
+#[derive(Clone, Debug, Default)]
+pub struct Stats {
+    /// The number of samples collected, including dropped ones.
+    pub samples: u64,
+    /// The number of samples lost by the plugin.
+    pub drops: u64,
+    /// The number of stacks truncated at the maximum depth.
+    pub max_depth: u64,
+    /// The number of stacks whose unwinding stopped because the stack could not be read.
+    pub read_errors: u64,
+    /// The number of bytes written by the plugin, before compression.
+    pub bytes: u64,
+    /// The time spent collecting samples, in nanoseconds.
+    pub sample_ns: u64,
+}
+
+impl Stats {
+    /// Reads the payload of a [`BLOCK_STATS`] block. Counters added by later versions of the
+    /// plugin are ignored.
+    pub fn read(mut payload: Input) -> io::Result<Self> {
+        Ok(Self {
+            samples: payload.varint()?,
+            drops: payload.varint()?,
+            max_depth: payload.varint()?,
+            read_errors: payload.varint()?,
+            bytes: payload.varint()?,
+            sample_ns: payload.varint()?,
+        })
+    }
+
+    /// Adds the counters of `other` to those of `self`.
+    pub fn add(&mut self, other: &Self) {
+        self.samples += other.samples;
+        self.drops += other.drops;
+        self.max_depth += other.max_depth;
+        self.read_errors += other.read_errors;
+        self.bytes += other.bytes;
+        self.sample_ns += other.sample_ns;
+    }
+}
+
+/// Returns an error for invalid data.
+pub fn invalid_data<E: Into<Box<dyn std::error::Error + Send + Sync>>>(msg: E) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+/// Returns an error for truncated data.
+pub fn truncated() -> io::Error {
+    io::Error::new(io::ErrorKind::UnexpectedEof, "truncated profile")
+}
+
+/// Decodes a zigzag-encoded signed value.
+pub fn unzigzag(val: u64) -> i64 {
+    ((val >> 1) as i64) ^ -((val & 1) as i64)
+}
+
+/// A cursor over profile data in memory.
+///
+/// Reading past the end of the data returns an error instead of panicking.
+pub struct Input<'d> {
+    /// The data left to be read.
+    data: &'d [u8],
+}
+
+impl<'d> Input<'d> {
+    /// Creates a cursor at the beginning of `data`.
+    pub fn new(data: &'d [u8]) -> Self {
+        Self { data }
+    }
+
+    /// Tells whether all the data has been read.
+    pub fn is_empty(&self) -> bool {
+        self.data.is_empty()
+    }
+
+    /// Returns the data left to be read.
+    pub fn remaining(&self) -> &'d [u8] {
+        self.data
+    }
+
+    /// Returns the next byte without consuming it.
+    pub fn peek(&self) -> Option<u8> {
+        self.data.first().copied()
+    }
+
+    /// Reads the next `len` bytes.
+    pub fn bytes(&mut self, len: usize) -> io::Result<&'d [u8]> {
+        if len > self.data.len() {
+            return Err(truncated());
+        }
+        let (bytes, rest) = self.data.split_at(len);
+        self.data = rest;
+        Ok(bytes)
+    }
+
+    /// Reads an array of `N` bytes.
+    pub fn array<const N: usize>(&mut self) -> io::Result<[u8; N]> {
+        Ok(self.bytes(N)?.try_into().unwrap())
+    }
+
+    /// Reads a [`u8`].
+    pub fn u8(&mut self) -> io::Result<u8> {
+        Ok(self.array::<1>()?[0])
+    }
+
+    /// Reads a little-endian [`u64`].
+    pub fn u64(&mut self) -> io::Result<u64> {
+        Ok(u64::from_le_bytes(self.array()?))
+    }
+
+    /// Reads an unsigned LEB128 varint.
+    pub fn varint(&mut self) -> io::Result<u64> {
+        let mut val = 0;
+        for (i, b) in self.data.iter().take(10).enumerate() {
+            val |= ((b & 0x7f) as u64) << (i * 7);
+            if b & 0x80 == 0 {
+                self.data = &self.data[i + 1..];
+                return Ok(val);
+            }
+        }
+        if self.data.len() < 10 {
+            Err(truncated())
+        } else {
+            Err(invalid_data("varint too long"))
+        }
+    }
+
+    /// Reads `depth` little-endian [`u64`] frames, without copying them.
+    pub fn frames(&mut self, depth: usize) -> io::Result<impl Iterator<Item = u64> + 'd> {
+        let bytes = self.bytes(depth * size_of::<u64>())?;
+        // Records are not aligned, so the frames cannot be borrowed as a `&[u64]`
+        Ok(bytes
+            .chunks_exact(size_of::<u64>())
+            .map(|b| u64::from_le_bytes(b.try_into().unwrap())))
+    }
+}
+
+/// Reads the header of the file, if present.
+///
+/// If the file is in the legacy format, the function returns `None` and leaves the input
+/// untouched.
+pub fn read_header(input: &mut Input) -> io::Result<Option<Header>> {
+    if input.peek() != Some(MAGIC[0]) {
+        return Ok(None);
+    }
+    let buf: [u8; HEADER_SIZE] = input.array()?;
+    if buf[..4] != MAGIC {
+        return Err(invalid_data("invalid magic number"));
+    }
+    let version = u16::from_le_bytes([buf[4], buf[5]]);
+    if version == 0 || version > VERSION {
+        return Err(invalid_data(format!(
+            "unsupported format version `{version}`"
+        )));
+    }
+    let len = u16::from_le_bytes([buf[6], buf[7]]) as usize;
+    let flags = buf[9];
+    if flags & !KNOWN_FLAGS != 0 {
+        return Err(invalid_data(format!("unsupported header flags `{flags:#x}`")));
+    }
+    let sample_mode = match buf[10] {
+        0 => SampleMode::Time,
+        1 => SampleMode::Instructions,
+        2 => SampleMode::Accesses,
+        m => return Err(invalid_data(format!("invalid sampling mode `{m}`"))),
+    };
+    let build_id_len = buf[11] as usize;
+    if len < HEADER_SIZE + build_id_len {
+        return Err(invalid_data("invalid header length"));
+    }
+    // Read the rest of the header, skipping fields added by later versions
+    let rest = input.bytes(len - HEADER_SIZE)?;
+    Ok(Some(Header {
+        version,
+        ptr_width: buf[8],
+        flags,
+        sample_mode,
+        vcpus: u32::from_le_bytes(buf[12..16].try_into().unwrap()),
+        sample_interval: u64::from_le_bytes(buf[16..24].try_into().unwrap()),
+        base: u64::from_le_bytes(buf[24..32].try_into().unwrap()),
+        build_id: (build_id_len > 0).then(|| rest[..build_id_len].to_vec()),
+    }))
+}
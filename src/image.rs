@@ -0,0 +1,184 @@
+//! ELF images whose code may show up in stacks: the kernel, its modules and userspace programs.
+
+use crate::build_id;
+use crate::lines::{LineFrame, LineTable};
+use crate::symbols::SymbolIndex;
+use anyhow::{bail, Result};
+use elf::endian::AnyEndian;
+use elf::ElfBytes;
+use memmap2::Mmap;
+use std::env;
+use std::fs;
+use std::fs::File;
+use std::hash::{DefaultHasher, Hasher};
+use std::path::{Path, PathBuf};
+
+/// An ELF image, loaded at a given address.
+pub struct Image {
+    /// The symbols of the image.
+    pub symbols: SymbolIndex,
+    /// The difference between the addresses at which the image is loaded and its addresses in the
+    /// ELF.
+    pub bias: u64,
+    /// The tag of the only address space in which the image is mapped (see
+    /// [`crate::format::FLAG_ADDRESS_SPACES`]). If `None`, the image is mapped in every address
+    /// space, like the kernel and its modules.
+    pub asid: Option<u64>,
+    /// The source lines of the image, if loaded.
+    pub lines: Option<LineTable>,
+}
+
+impl Image {
+    /// Loads the symbols of the ELF at `path`.
+    ///
+    /// If `symbol_cache` is set, symbols are loaded from the cache if present, and saved there
+    /// otherwise (see [`symbol_cache_path`]).
+    ///
+    /// If `lines` is set, the source lines of the ELF are loaded as well, from the same cache,
+    /// or built on the given number of threads. An ELF without debugging information only has
+    /// its symbols.
+    ///
+    /// The function also returns the build ID of the ELF, if present.
+    pub fn load(
+        path: &Path,
+        bias: u64,
+        asid: Option<u64>,
+        symbol_cache: bool,
+        lines: Option<usize>,
+    ) -> Result<(Self, Option<Vec<u8>>)> {
+        let file = File::open(path)?;
+        // Safety: the file must not be modified while mapped
+        let buf = unsafe { Mmap::map(&file)? };
+        let elf = ElfBytes::<AnyEndian>::minimal_parse(&buf)?;
+        let build_id = build_id(&elf)?;
+        let cache_path = symbol_cache.then(|| symbol_cache_path(&buf, build_id)).flatten();
+        let symbols_path = cache_path.as_ref().map(|p| p.with_extension("sym"));
+        let symbols = match symbols_path.as_deref().and_then(|p| SymbolIndex::load(p).ok()) {
+            Some(symbols) => symbols,
+            None => {
+                let Some(symbols) = SymbolIndex::from_elf(&elf)? else {
+                    bail!("ELF does not have a symbol table!");
+                };
+                if let Some(path) = &symbols_path {
+                    let res = fs::create_dir_all(path.parent().unwrap()).and_then(|_| symbols.save(path));
+                    if let Err(e) = res {
+                        eprintln!("warning: could not save symbol cache at `{}`: {e}", path.display());
+                    }
+                }
+                symbols
+            }
+        };
+        let lines = match lines {
+            Some(jobs) => {
+                let lines_path = cache_path.as_ref().map(|p| p.with_extension("lines"));
+                let lines = load_lines(&elf, lines_path.as_deref(), jobs)?;
+                if lines.is_none() {
+                    eprintln!("warning: `{}` does not have line information", path.display());
+                }
+                lines
+            }
+            None => None,
+        };
+        let image = Self {
+            symbols,
+            bias,
+            asid,
+            lines,
+        };
+        Ok((image, build_id.map(<[u8]>::to_vec)))
+    }
+
+    /// Returns the name of the symbol in which the address is located, in the address space with
+    /// the tag `asid`.
+    pub fn lookup(&self, asid: u64, addr: u64) -> Option<&str> {
+        if self.asid.is_some_and(|a| a != asid) {
+            return None;
+        }
+        self.symbols.lookup(addr.checked_sub(self.bias)?)
+    }
+
+    /// Returns the chain of frames of the address from the source lines of the image (see
+    /// [`LineTable::lookup`]), in the address space with the tag `asid`.
+    pub fn lookup_lines(
+        &self,
+        asid: u64,
+        addr: u64,
+    ) -> Option<impl Iterator<Item = LineFrame<'_>>> {
+        if self.asid.is_some_and(|a| a != asid) {
+            return None;
+        }
+        self.lines.as_ref()?.lookup(addr.checked_sub(self.bias)?)
+    }
+}
+
+/// Loads the source lines of the ELF from the cache file at `cache_path` if present, or builds
+/// them on `jobs` threads and saves them there.
+fn load_lines(
+    elf: &ElfBytes<AnyEndian>,
+    cache_path: Option<&Path>,
+    jobs: usize,
+) -> Result<Option<LineTable>> {
+    if let Some(lines) = cache_path.and_then(|p| LineTable::load(p).ok()) {
+        return Ok(Some(lines));
+    }
+    let Some(lines) = LineTable::from_elf(elf, jobs)? else {
+        return Ok(None);
+    };
+    if let Some(path) = cache_path {
+        let res = fs::create_dir_all(path.parent().unwrap()).and_then(|_| lines.save(path));
+        if let Err(e) = res {
+            eprintln!("warning: could not save line cache at `{}`: {e}", path.display());
+        }
+    }
+    Ok(Some(lines))
+}
+
+/// Parses an integer given on the command line, in decimal or in hexadecimal with the `0x` prefix.
+fn parse_int(s: &str) -> Option<u64> {
+    match s.strip_prefix("0x") {
+        Some(hex) => u64::from_str_radix(hex, 16).ok(),
+        None => s.parse().ok(),
+    }
+}
+
+/// Parses the description of an image given on the command line:
+/// `<path>[,base=<address>][,asid=<tag>]`.
+///
+/// The function returns the path, the address at which the image is loaded (which is added to the
+/// addresses of its symbols), and the tag of its address space.
+pub fn parse_spec(spec: &str) -> Option<(PathBuf, u64, Option<u64>)> {
+    let mut parts = spec.split(',');
+    let path = PathBuf::from(parts.next()?);
+    let mut base = 0;
+    let mut asid = None;
+    for part in parts {
+        let (name, val) = part.split_once('=')?;
+        match name {
+            "base" => base = parse_int(val)?,
+            "asid" => asid = Some(parse_int(val)? & !0xfff),
+            _ => return None,
+        }
+    }
+    Some((path, base, asid))
+}
+
+/// Returns the path of the cache files of the given ELF, in the user's cache directory, without
+/// extension: `.sym` is added for symbols, and `.lines` for source lines.
+///
+/// Cache files are named after the build ID of the ELF, or a hash of its content if it has none.
+/// If no cache directory is known, the function returns `None`.
+fn symbol_cache_path(elf_buf: &[u8], build_id: Option<&[u8]>) -> Option<PathBuf> {
+    let dir = match env::var_os("XDG_CACHE_HOME").filter(|d| !d.is_empty()) {
+        Some(dir) => PathBuf::from(dir),
+        None => PathBuf::from(env::var_os("HOME")?).join(".cache"),
+    };
+    let key = match build_id {
+        Some(id) => id.iter().map(|b| format!("{b:02x}")).collect(),
+        None => {
+            let mut hasher = DefaultHasher::new();
+            hasher.write(elf_buf);
+            format!("hash-{:016x}", hasher.finish())
+        }
+    };
+    Some(dir.join("kern-profile").join(key))
+}
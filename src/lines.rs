@@ -0,0 +1,461 @@
+//! Table of the source lines of the kernel, to resolve addresses to lines and to the functions
+//! inlined there.
+//!
+//! The table is built once from the DWARF debugging information (`.debug_line` and
+//! `.debug_info`): each range of addresses generated from a given line is associated with its
+//! chain of frames, from the innermost inlined function to the function it has been inlined in.
+//! Consecutive ranges with the same chain are merged, and identical chains are stored once.
+//!
+//! Like the symbol index (see [`crate::symbols`]), the table can be saved to a cache file, in
+//! which arrays are stored one after the other after a header (see [`HEADER_SIZE`]): start
+//! addresses of ranges (`u64`), end addresses (`u64`), chain of each range (`u32`), offsets of
+//! chains (`u32`), frames (three `u32` each: function, file and line), offsets of strings (`u32`)
+//! and the strings arena. Values are in the host's byte order.
+
+use crate::image::Image;
+use anyhow::{bail, Result};
+use elf::endian::AnyEndian;
+use elf::ElfBytes;
+use gimli::{EndianSlice, LittleEndian, SectionId};
+use rustc_demangle::demangle;
+use std::collections::HashMap;
+use std::fs;
+use std::fs::File;
+use std::io;
+use std::io::Write;
+use std::iter;
+use std::mem::size_of;
+use std::str;
+use std::thread;
+
+/// The magic number at the beginning of cache files.
+const MAGIC: [u8; 4] = *b"\x7fKPL";
+/// The version of the layout of cache files.
+const VERSION: u16 = 1;
+/// The size of the header of cache files: magic number, version (`u16`), padding (`u16`), number
+/// of ranges (`u32`), number of chains (`u32`), number of frames (`u32`), number of strings
+/// (`u32`), size of the strings arena (`u32`), padding (`u32`).
+const HEADER_SIZE: usize = 32;
+
+/// Returns an error for an invalid cache file.
+fn invalid_cache() -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, "invalid line cache")
+}
+
+/// A frame of a chain, with IDs of strings.
+#[derive(Clone, Copy, Eq, Hash, PartialEq)]
+struct RawFrame {
+    function: u32,
+    file: u32,
+    line: u32,
+}
+
+/// A frame of the chain of an address.
+pub struct LineFrame<'t> {
+    /// The name of the function, demangled.
+    pub function: &'t str,
+    /// The path of the source file.
+    pub file: &'t str,
+    /// The line in the source file, or zero if unknown.
+    pub line: u32,
+}
+
+/// Interning of the strings of a table being built.
+#[derive(Default)]
+struct Strings {
+    offs: Vec<u32>,
+    arena: String,
+    ids: HashMap<String, u32>,
+}
+
+impl Strings {
+    fn intern(&mut self, s: &str) -> u32 {
+        if let Some(id) = self.ids.get(s) {
+            return *id;
+        }
+        let id = self.offs.len() as u32;
+        self.offs.push(self.arena.len() as u32);
+        self.arena.push_str(s);
+        self.ids.insert(s.to_owned(), id);
+        id
+    }
+
+    fn get(&self, id: u32) -> &str {
+        let start = self.offs[id as usize] as usize;
+        let end = self.offs.get(id as usize + 1).map_or(self.arena.len(), |o| *o as usize);
+        &self.arena[start..end]
+    }
+}
+
+/// A table being built, for a part of the ranges.
+#[derive(Default)]
+struct Builder {
+    strings: Strings,
+    /// The ID of each chain.
+    chain_ids: HashMap<Vec<RawFrame>, u32>,
+    /// The frames of all chains.
+    frames: Vec<RawFrame>,
+    /// The end offset of each chain in `frames`.
+    chain_ends: Vec<u32>,
+    /// The start address, end address and chain of each range, in any order.
+    ranges: Vec<(u64, u64, u32)>,
+}
+
+impl Builder {
+    /// Returns the ID of the given chain, allocating one if necessary.
+    fn intern_chain(&mut self, chain: &[RawFrame]) -> u32 {
+        if let Some(id) = self.chain_ids.get(chain) {
+            return *id;
+        }
+        let id = self.chain_ends.len() as u32;
+        self.frames.extend_from_slice(chain);
+        self.chain_ends.push(self.frames.len() as u32);
+        self.chain_ids.insert(chain.to_vec(), id);
+        id
+    }
+
+    /// Adds the ranges of `other`, with its strings and chains.
+    fn merge(&mut self, other: Builder) {
+        let strings: Vec<u32> = (0..other.strings.offs.len() as u32)
+            .map(|id| self.strings.intern(other.strings.get(id)))
+            .collect();
+        let mut chain = Vec::new();
+        let mut chain_start = 0;
+        let chains: Vec<u32> = other
+            .chain_ends
+            .iter()
+            .map(|end| {
+                chain.clear();
+                chain.extend(other.frames[chain_start..*end as usize].iter().map(|f| RawFrame {
+                    function: strings[f.function as usize],
+                    file: strings[f.file as usize],
+                    line: f.line,
+                }));
+                chain_start = *end as usize;
+                self.intern_chain(&chain)
+            })
+            .collect();
+        let ranges = other.ranges.iter().map(|(s, e, c)| (*s, *e, chains[*c as usize]));
+        self.ranges.extend(ranges);
+    }
+
+    /// Returns the table made of the ranges.
+    fn finish(mut self) -> LineTable {
+        self.ranges.sort_unstable_by_key(|(start, _, _)| *start);
+        let mut table = LineTable {
+            starts: vec![],
+            ends: vec![],
+            range_chains: vec![],
+            chain_offs: iter::once(0).chain(self.chain_ends).collect(),
+            frames: self.frames,
+            string_offs: self.strings.offs,
+            strings: self.strings.arena,
+        };
+        table.string_offs.push(table.strings.len() as u32);
+        for (start, end, chain) in self.ranges {
+            // Merge with the previous range if contiguous and identical
+            if table.ends.last() == Some(&start) && table.range_chains.last() == Some(&chain) {
+                *table.ends.last_mut().unwrap() = end;
+                continue;
+            }
+            // Ranges of different units may overlap, in which case the first one is kept
+            let start = table.ends.last().map_or(start, |e| start.max(*e));
+            if start < end {
+                table.starts.push(start);
+                table.ends.push(end);
+                table.range_chains.push(chain);
+            }
+        }
+        table
+    }
+}
+
+/// The DWARF sections of an ELF.
+type Dwarf<'e> = gimli::Dwarf<EndianSlice<'e, LittleEndian>>;
+
+/// Returns the DWARF sections of the ELF.
+fn load_dwarf<'e>(elf: &ElfBytes<'e, AnyEndian>) -> Result<Dwarf<'e>> {
+    gimli::Dwarf::load(|id: SectionId| -> Result<_> {
+        let data = match elf.section_header_by_name(id.name())? {
+            Some(shdr) => match elf.section_data(&shdr)? {
+                (data, None) => data,
+                (_, Some(_)) => bail!("compressed debugging information is not supported"),
+            },
+            None => &[],
+        };
+        Ok(EndianSlice::new(data, LittleEndian))
+    })
+}
+
+/// Adds the given line ranges to `builder`, with the chain of functions inlined at each one.
+fn add_ranges(
+    builder: &mut Builder,
+    ctx: &addr2line::Context<EndianSlice<LittleEndian>>,
+    ranges: &[(u64, u64)],
+) -> Result<()> {
+    let mut chain = Vec::new();
+    for (start, end) in ranges {
+        chain.clear();
+        let mut frames = ctx.find_frames(*start).skip_all_loads()?;
+        while let Some(frame) = frames.next()? {
+            let function = match &frame.function {
+                Some(f) => format!("{:#}", demangle(&f.raw_name()?)),
+                None => "???".to_owned(),
+            };
+            let location = frame.location.as_ref();
+            chain.push(RawFrame {
+                function: builder.strings.intern(&function),
+                file: builder.strings.intern(location.and_then(|l| l.file).unwrap_or("???")),
+                line: location.and_then(|l| l.line).unwrap_or(0),
+            });
+        }
+        if !chain.is_empty() {
+            let id = builder.intern_chain(&chain);
+            builder.ranges.push((*start, *end, id));
+        }
+    }
+    Ok(())
+}
+
+/// Source lines sorted by address, without overlaps.
+pub struct LineTable {
+    /// The start address of each range.
+    starts: Vec<u64>,
+    /// The end address (exclusive) of each range.
+    ends: Vec<u64>,
+    /// The chain of each range.
+    range_chains: Vec<u32>,
+    /// The offset of each chain in `frames`. The last element is the end of the last chain.
+    chain_offs: Vec<u32>,
+    /// The frames of all chains, each chain from the innermost to the outermost.
+    frames: Vec<RawFrame>,
+    /// The offset of each string in the arena. The last element is the end of the last string.
+    string_offs: Vec<u32>,
+    /// The strings: names of functions and paths of files.
+    strings: String,
+}
+
+impl LineTable {
+    /// Builds the table from the DWARF debugging information of the ELF, on `jobs` threads.
+    ///
+    /// Resolving the functions inlined at each line is what takes time. Line ranges are split
+    /// among threads, each one parsing the functions of the units its ranges belong to.
+    ///
+    /// If the ELF does not have line information, the function returns `None`.
+    pub fn from_elf(elf: &ElfBytes<AnyEndian>, jobs: usize) -> Result<Option<Self>> {
+        if elf.section_header_by_name(".debug_line")?.is_none() {
+            return Ok(None);
+        }
+        let ctx = addr2line::Context::from_dwarf(load_dwarf(elf)?)?;
+        let ranges: Vec<(u64, u64)> = ctx
+            .find_location_range(0, u64::MAX)?
+            .filter(|(_, len, _)| *len > 0)
+            .map(|(addr, len, _)| (addr, addr.saturating_add(len)))
+            .collect();
+        let chunk_len = ranges.len().div_ceil(jobs).max(1);
+        let mut chunks = ranges.chunks(chunk_len);
+        // The first chunk is handled by the current thread, with the context already built
+        let mut builder = Builder::default();
+        let first = chunks.next().unwrap_or_default();
+        let builders = thread::scope(|scope| {
+            let workers: Vec<_> = chunks
+                .map(|chunk| {
+                    scope.spawn(move || -> Result<Builder> {
+                        let ctx = addr2line::Context::from_dwarf(load_dwarf(elf)?)?;
+                        let mut builder = Builder::default();
+                        add_ranges(&mut builder, &ctx, chunk)?;
+                        Ok(builder)
+                    })
+                })
+                .collect();
+            add_ranges(&mut builder, &ctx, first)?;
+            workers
+                .into_iter()
+                .map(|w| w.join().unwrap())
+                .collect::<Result<Vec<_>>>()
+        })?;
+        for other in builders {
+            builder.merge(other);
+        }
+        Ok(Some(builder.finish()))
+    }
+
+    /// Loads a table previously saved with [`Self::save`].
+    ///
+    /// If the file is not a valid cache file, the function returns an error of kind
+    /// [`io::ErrorKind::InvalidData`].
+    pub fn load(path: &std::path::Path) -> io::Result<Self> {
+        let buf = fs::read(path)?;
+        let header = buf.get(..HEADER_SIZE).ok_or_else(invalid_cache)?;
+        let u32_at = |off: usize| u32::from_ne_bytes(header[off..off + 4].try_into().unwrap());
+        if header[..4] != MAGIC || u16::from_ne_bytes([header[4], header[5]]) != VERSION {
+            return Err(invalid_cache());
+        }
+        let [ranges, chains, frames, strings, arena] = [8, 12, 16, 20, 24].map(|o| u32_at(o) as usize);
+        let mut rest = &buf[HEADER_SIZE..];
+        let mut take = |len: usize| -> io::Result<&[u8]> {
+            if len > rest.len() {
+                return Err(invalid_cache());
+            }
+            let (bytes, r) = rest.split_at(len);
+            rest = r;
+            Ok(bytes)
+        };
+        let mut u64s = |len: usize| -> io::Result<Vec<u64>> {
+            Ok(take(len * size_of::<u64>())?
+                .chunks_exact(size_of::<u64>())
+                .map(|b| u64::from_ne_bytes(b.try_into().unwrap()))
+                .collect())
+        };
+        let starts = u64s(ranges)?;
+        let ends = u64s(ranges)?;
+        let mut u32s = |len: usize| -> io::Result<Vec<u32>> {
+            Ok(take(len * size_of::<u32>())?
+                .chunks_exact(size_of::<u32>())
+                .map(|b| u32::from_ne_bytes(b.try_into().unwrap()))
+                .collect())
+        };
+        let range_chains = u32s(ranges)?;
+        let chain_offs = u32s(chains + 1)?;
+        let frames = u32s(frames * 3)?
+            .chunks_exact(3)
+            .map(|f| RawFrame {
+                function: f[0],
+                file: f[1],
+                line: f[2],
+            })
+            .collect::<Vec<_>>();
+        let string_offs = u32s(strings + 1)?;
+        let arena = str::from_utf8(take(arena)?).map_err(|_| invalid_cache())?;
+        // Check references, so that lookups cannot go out of bounds
+        let valid = range_chains.iter().all(|c| (*c as usize) < chains)
+            && chain_offs.windows(2).all(|w| w[0] <= w[1])
+            && chain_offs.last().is_some_and(|o| *o as usize == frames.len())
+            && frames
+                .iter()
+                .all(|f| (f.function as usize) < strings && (f.file as usize) < strings)
+            && string_offs.windows(2).all(|w| w[0] <= w[1])
+            && string_offs.last().is_some_and(|o| *o as usize == arena.len())
+            && string_offs.iter().all(|o| arena.is_char_boundary(*o as usize));
+        if !valid {
+            return Err(invalid_cache());
+        }
+        Ok(Self {
+            starts,
+            ends,
+            range_chains,
+            chain_offs,
+            frames,
+            string_offs,
+            strings: arena.to_owned(),
+        })
+    }
+
+    /// Saves the table at `path`, to be loaded with [`Self::load`].
+    ///
+    /// The file is written next to its destination first, then renamed, so that a table being
+    /// saved is never seen partially written.
+    pub fn save(&self, path: &std::path::Path) -> io::Result<()> {
+        let mut buf = Vec::new();
+        buf.extend_from_slice(&MAGIC);
+        buf.extend_from_slice(&VERSION.to_ne_bytes());
+        buf.extend_from_slice(&[0; 2]);
+        for len in [
+            self.starts.len(),
+            self.chain_offs.len() - 1,
+            self.frames.len(),
+            self.string_offs.len() - 1,
+            self.strings.len(),
+            0,
+        ] {
+            buf.extend_from_slice(&(len as u32).to_ne_bytes());
+        }
+        for v in self.starts.iter().chain(&self.ends) {
+            buf.extend_from_slice(&v.to_ne_bytes());
+        }
+        let frames = self.frames.iter().flat_map(|f| [f.function, f.file, f.line]);
+        let u32s = self
+            .range_chains
+            .iter()
+            .chain(&self.chain_offs)
+            .copied()
+            .chain(frames)
+            .chain(self.string_offs.iter().copied());
+        for v in u32s {
+            buf.extend_from_slice(&v.to_ne_bytes());
+        }
+        buf.extend_from_slice(self.strings.as_bytes());
+
+        let tmp = path.with_extension(format!("tmp{}", std::process::id()));
+        let mut file = File::create(&tmp)?;
+        file.write_all(&buf)?;
+        drop(file);
+        fs::rename(tmp, path)
+    }
+
+    /// Returns the string with the given ID.
+    fn string(&self, id: u32) -> &str {
+        let (start, end) = (self.string_offs[id as usize], self.string_offs[id as usize + 1]);
+        &self.strings[start as usize..end as usize]
+    }
+
+    /// Returns the chain of frames of the address, from the innermost inlined function to the
+    /// function it has been inlined in. The first frame gives the line of the address itself.
+    pub fn lookup(&self, addr: u64) -> Option<impl Iterator<Item = LineFrame<'_>>> {
+        let i = self.starts.partition_point(|s| *s <= addr).checked_sub(1)?;
+        if addr >= self.ends[i] {
+            return None;
+        }
+        let chain = self.range_chains[i] as usize;
+        let (start, end) = (self.chain_offs[chain], self.chain_offs[chain + 1]);
+        Some(
+            self.frames[start as usize..end as usize]
+                .iter()
+                .map(|f| LineFrame {
+                    function: self.string(f.function),
+                    file: self.string(f.file),
+                    line: f.line,
+                }),
+        )
+    }
+}
+
+/// Writes the number of samples of each source line, from the most sampled to the least, given
+/// the number of samples of each leaf address by address space tag. The most sampled address of
+/// each line is given as well, to find its instructions in a disassembly.
+///
+/// Addresses without source lines are counted under their symbol, with an unknown line.
+pub fn write_report<W: Write>(
+    images: &[Image],
+    leaves: &HashMap<(u64, u64), u64>,
+    out: &mut W,
+) -> io::Result<()> {
+    let total: u64 = leaves.values().sum();
+    // For each function, file and line: the number of samples, then the most sampled address
+    // with its own number of samples
+    let mut lines: HashMap<(&str, &str, u32), (u64, u64, u64)> = HashMap::new();
+    for ((asid, addr), count) in leaves {
+        let line = images.iter().find_map(|i| i.lookup_lines(*asid, *addr)?.next());
+        let key = match line {
+            Some(f) => (f.function, f.file, f.line),
+            None => {
+                let symbol = images.iter().find_map(|i| i.lookup(*asid, *addr));
+                (symbol.unwrap_or("???"), "???", 0)
+            }
+        };
+        let (samples, hottest, hottest_samples) = lines.entry(key).or_insert((0, *addr, 0));
+        *samples += count;
+        if (*count, u64::MAX - *addr) > (*hottest_samples, u64::MAX - *hottest) {
+            (*hottest, *hottest_samples) = (*addr, *count);
+        }
+    }
+    let mut lines: Vec<_> = lines.into_iter().collect();
+    // Ties are sorted by line, so that the report is stable
+    lines.sort_unstable_by(|(k1, (c1, _, _)), (k2, (c2, _, _))| c2.cmp(c1).then(k1.cmp(k2)));
+    writeln!(out, "{:>9} {:>8}  {:<18}  line", "samples", "share", "address")?;
+    for ((function, file, line), (samples, hottest, _)) in lines {
+        let share = samples as f64 * 100.0 / total as f64;
+        writeln!(out, "{samples:>9} {share:>7.2}%  {hottest:#018x}  {file}:{line} ({function})")?;
+    }
+    Ok(())
+}
@@ -1,245 +1,1418 @@
-#![feature(iter_array_chunks)]
-#![feature(iter_intersperse)]
+#![cfg_attr(test, feature(test))]
+
+mod compress;
+mod diff;
+mod flamegraph;
+mod follow;
+mod format;
+mod image;
+mod lines;
+mod pprof;
+mod symbols;
+mod tree;
+mod unwind;
 
 use anyhow::Result;
 use elf::endian::AnyEndian;
 use elf::ElfBytes;
-use elf::ParseError;
-use rustc_demangle::demangle;
-use std::cmp::Ordering;
+use flamegraph::Palette;
+use format::{
+    Header, Input, SampleMode, Stats, FLAG_ADDRESS_SPACES, FLAG_AGGREGATED, FLAG_CONTEXTS,
+    FLAG_STATS, FLAG_TIMESTAMPS,
+};
+use image::Image;
+use memmap2::Mmap;
 use std::collections::HashMap;
 use std::env;
 use std::ffi::OsString;
 use std::fs;
 use std::fs::File;
+use std::hash::Hash;
 use std::io;
 use std::io::BufWriter;
-use std::io::Read;
 use std::io::Write;
-use std::io::{BufReader, Bytes};
+use std::iter;
+use std::mem;
 use std::mem::size_of;
-use std::process::{exit, Command, Stdio};
+use std::num::NonZeroUsize;
+use std::path::{Path, PathBuf};
+use std::process::{exit, ChildStdin, Command, Stdio};
+use std::thread;
+use std::time::Duration;
+use tree::{CallTree, FrameNames};
 
-struct Symbol {
-    addr: u64,
-    size: u64,
-    name: String,
+/// Returns the GNU build ID of the ELF, if present.
+fn build_id<'e>(elf: &ElfBytes<'e, AnyEndian>) -> Result<Option<&'e [u8]>> {
+    let Some(shdr) = elf.section_header_by_name(".note.gnu.build-id")? else {
+        return Ok(None);
+    };
+    let (notes, _) = elf.section_data(&shdr)?;
+    // Parse notes, looking for the build ID
+    let mut notes = notes;
+    while notes.len() >= 12 {
+        let word = |off: usize| u32::from_le_bytes(notes[off..off + 4].try_into().unwrap()) as usize;
+        let (name_size, desc_size, kind) = (word(0), word(4), word(8));
+        let desc_off = 12 + name_size.next_multiple_of(4);
+        let end = desc_off + desc_size.next_multiple_of(4);
+        if end > notes.len() {
+            break;
+        }
+        // NT_GNU_BUILD_ID
+        if kind == 3 && &notes[12..12 + name_size] == b"GNU\0" {
+            return Ok(Some(&notes[desc_off..desc_off + desc_size]));
+        }
+        notes = &notes[end..];
+    }
+    Ok(None)
 }
 
-/// Loads the symbols list, sorted by address.
+/// A set of stacks of raw addresses, not resolved to symbols yet, with the associated number of
+/// occurrences for each. Frames are ordered from the innermost to the outermost.
+type RawStacks = HashMap<Vec<u64>, u64>;
+
+/// Raw frame inserted above the frames of an interrupt or exception handler, before the frame
+/// where it has been taken (see [`FLAG_CONTEXTS`]). It is resolved to `[irq]`.
+const CONTEXT_BOUNDARY: u64 = u64::MAX;
+
+/// Adds the counts of `from` to `into`.
 ///
-/// If no symbol table is present, the function returns `None`.
-fn list_symbols(elf_path: &OsString) -> Result<Option<Vec<Symbol>>> {
-    let elf_buf = fs::read(elf_path)?;
-    let elf = ElfBytes::<AnyEndian>::minimal_parse(&elf_buf)?;
-    let symbol_table = elf.symbol_table()?;
-    let Some((symbol_table, string_table)) = symbol_table else {
-        return Ok(None);
-    };
+/// The smallest map is inserted into the largest one, so that as few entries as possible are
+/// moved.
+fn merge_stacks<K: Eq + Hash>(into: &mut HashMap<K, u64>, mut from: HashMap<K, u64>) {
+    if into.len() < from.len() {
+        mem::swap(into, &mut from);
+    }
+    for (stack, count) in from {
+        *into.entry(stack).or_insert(0) += count;
+    }
+}
 
-    let mut syms = symbol_table
-        .iter()
-        .map(|sym| {
-            let name = string_table.get(sym.st_name as _)?;
-            Ok::<_, ParseError>(Symbol {
-                addr: sym.st_value,
-                size: sym.st_size,
-                name: format!("{:#}", demangle(name)),
-            })
-        })
-        .collect::<Result<Vec<_>, _>>()?;
-    syms.sort_unstable_by(|s1, s2| s1.addr.cmp(&s2.addr).then_with(|| s1.size.cmp(&s2.size)));
-    Ok(Some(syms))
-}
-
-/// Returns the name of the symbol in which the address is located.
-fn find_symbol(symbols: &[Symbol], addr: u64) -> Option<&str> {
-    let index = symbols
-        .binary_search_by(|sym| {
-            if addr < sym.addr {
-                Ordering::Greater
-            } else if addr >= sym.addr + sym.size {
-                Ordering::Less
-            } else {
-                Ordering::Equal
+/// Counts a stack of raw frames.
+fn fold_raw(raw_stacks: &mut RawStacks, frames: &[u64], count: u64) {
+    // Avoid allocating if the stack is already present
+    match raw_stacks.get_mut(frames) {
+        Some(c) => *c += count,
+        None => {
+            raw_stacks.insert(frames.to_vec(), count);
+        }
+    }
+}
+
+/// Counts a stack of interned frames, from the innermost to the outermost, subdivided into
+/// substacks at frames that could not be resolved.
+///
+/// `substack` is a buffer reused across calls to avoid allocations.
+fn fold_frames<I: Iterator<Item = Option<u32>>>(
+    tree: &mut CallTree,
+    frames: I,
+    count: u64,
+    substack: &mut Vec<u32>,
+) {
+    let mut frames = frames.peekable();
+    // Subdivide stack into substacks (interruptions handling)
+    while frames.peek().is_some() {
+        substack.clear();
+        substack.extend(frames.by_ref().map_while(|f| f));
+        if substack.is_empty() {
+            continue;
+        }
+        // Increment counter
+        tree.add(substack.iter().rev().copied(), count);
+    }
+}
+
+/// Resolution of addresses to interned frames.
+struct Resolver<'s> {
+    /// The images addresses are resolved against. The first one is the kernel.
+    images: &'s [Image],
+    /// The names of frames.
+    names: FrameNames<'s>,
+    /// The frame of each address already resolved, by address space tag and address. Stacks share
+    /// most of their addresses, so each one is only looked up once.
+    cache: HashMap<(u64, u64), Option<u32>>,
+    /// Tells whether the functions inlined at each address are frames of their own, according to
+    /// the source lines of images.
+    lines: bool,
+    /// With `lines`, the frames of each address already resolved, by address space tag and
+    /// address, as the start and length of a range of `chain_frames`. An empty range means that
+    /// the address could not be resolved.
+    chains: HashMap<(u64, u64), (u32, u32)>,
+    /// The frames of the ranges of `chains`, from the innermost to the outermost.
+    chain_frames: Vec<u32>,
+    /// Tells whether stacks have context boundaries (see [`FLAG_CONTEXTS`]). If so, frames that
+    /// could not be resolved are named `[unknown]`. Otherwise, they are most likely where an
+    /// interrupt has been taken, and stacks are split there.
+    contexts: bool,
+}
+
+impl<'s> Resolver<'s> {
+    fn new(images: &'s [Image], lines: bool) -> Self {
+        Self {
+            images,
+            names: FrameNames::default(),
+            cache: HashMap::new(),
+            lines,
+            chains: HashMap::new(),
+            chain_frames: Vec::new(),
+            contexts: false,
+        }
+    }
+
+    /// Prepares the resolution of the stacks of the CPU profile with the given header, or `None`
+    /// for files in the legacy format.
+    fn set_profile(&mut self, header: Option<&Header>) {
+        self.contexts = header.is_some_and(|h| h.flags & FLAG_CONTEXTS != 0);
+    }
+
+    /// Returns the frame of a raw frame resolved to `frame`, which is `None` for addresses that
+    /// could not be resolved. Context boundaries are resolved here as well.
+    fn context_frame(&mut self, addr: u64, frame: Option<u32>) -> Option<u32> {
+        if addr == CONTEXT_BOUNDARY {
+            return Some(self.names.intern("[irq]"));
+        }
+        match frame {
+            None if self.contexts => Some(self.names.intern("[unknown]")),
+            _ => frame,
+        }
+    }
+
+    /// Returns the name of the symbol in which the address is located, in the address space with
+    /// the tag `asid`, among all images.
+    fn lookup(&self, asid: u64, addr: u64) -> Option<&'s str> {
+        self.images.iter().find_map(|image| image.lookup(asid, addr))
+    }
+
+    /// Returns the range of `chain_frames` with the frames of the address, in the address space
+    /// with the tag `asid`: the functions inlined at the address, then the function they have
+    /// been inlined in. Images without source lines only give the latter.
+    fn lookup_chain(&mut self, asid: u64, addr: u64) -> (usize, usize) {
+        if let Some((start, len)) = self.chains.get(&(asid, addr)) {
+            return (*start as usize, *len as usize);
+        }
+        let images = self.images;
+        let start = self.chain_frames.len();
+        for image in images {
+            if let Some(frames) = image.lookup_lines(asid, addr) {
+                self.chain_frames.extend(frames.map(|f| self.names.intern(f.function)));
+                break;
             }
-        })
-        .ok()?;
-    Some(symbols[index].name.as_str())
+            if let Some(name) = image.lookup(asid, addr) {
+                self.chain_frames.push(self.names.intern(name));
+                break;
+            }
+        }
+        let len = self.chain_frames.len() - start;
+        self.chains.insert((asid, addr), (start as u32, len as u32));
+        (start, len)
+    }
+
+    /// Resolves the frames of `raw_stacks`, collected in the address space with the tag `asid`,
+    /// and adds the resulting stacks to `tree`.
+    fn resolve_stacks(&mut self, tree: &mut CallTree, asid: u64, raw_stacks: RawStacks) {
+        let mut substack = Vec::new();
+        if self.lines {
+            let mut frames = Vec::new();
+            for (addrs, count) in raw_stacks {
+                for (i, addr) in addrs.iter().enumerate() {
+                    if *addr == CONTEXT_BOUNDARY {
+                        frames.push(self.context_frame(*addr, None));
+                        continue;
+                    }
+                    // Frames other than the leaf and interrupted instructions are return
+                    // addresses, which may be the first instruction of the next line
+                    let interrupted = i == 0 || addrs[i - 1] == CONTEXT_BOUNDARY;
+                    let lookup_addr = if interrupted { *addr } else { addr.wrapping_sub(1) };
+                    match self.lookup_chain(asid, lookup_addr) {
+                        (_, 0) => frames.push(self.context_frame(*addr, None)),
+                        (start, len) => {
+                            let chain = &self.chain_frames[start..start + len];
+                            frames.extend(chain.iter().map(|f| Some(*f)));
+                        }
+                    }
+                }
+                fold_frames(tree, frames.drain(..), count, &mut substack);
+            }
+            return;
+        }
+        for (frames, count) in raw_stacks {
+            let frames = frames.iter().map(|addr| {
+                let frame = match self.cache.get(&(asid, *addr)) {
+                    Some(frame) => *frame,
+                    None => {
+                        let frame = self.lookup(asid, *addr).map(|name| self.names.intern(name));
+                        self.cache.insert((asid, *addr), frame);
+                        frame
+                    }
+                };
+                self.context_frame(*addr, frame)
+            });
+            fold_frames(tree, frames, count, &mut substack);
+        }
+    }
 }
 
-/// Returns an iterator over a stack in **memtrace** format.
-fn stack_iter<'i, 's: 'i, I: Iterator<Item = io::Result<u8>>>(
-    iter: &'i mut I,
-    symbols: &'s [Symbol],
-) -> io::Result<impl Iterator<Item = Option<&'s str>> + 'i> {
-    let stack_depth = iter.next().transpose()?.unwrap_or(0) as usize;
-    Ok(iter
-        .take(stack_depth * size_of::<u64>())
-        .map(|r| r.unwrap()) // TODO handle error
-        .array_chunks()
-        .map(u64::from_le_bytes)
-        .map(|addr| find_symbol(symbols, addr)))
+/// Selection of CPU samples according to their timestamp.
+///
+/// The unit of timestamps depends on the sampling mode of the profile: nanoseconds since the plugin
+/// was loaded for time based sampling, or number of instructions executed (or memory accesses
+/// made) by the vCPU.
+#[derive(Default)]
+struct Window {
+    /// Samples before this timestamp are ignored.
+    from: Option<u64>,
+    /// Samples at or after this timestamp are ignored.
+    to: Option<u64>,
+    /// If set, samples are split in consecutive slices of this width, starting at `from`.
+    slice: Option<u64>,
 }
 
-/// Returns a [`u64`] from the data in the given iterator.
-fn next_u64<I: Iterator<Item = io::Result<u8>>>(iter: &mut I) -> io::Result<Option<u64>> {
-    Ok(iter
-        .map(|r| r.unwrap()) // TODO handle error
-        .array_chunks()
-        .map(u64::from_le_bytes)
-        .next())
+impl Window {
+    /// Tells whether samples are selected according to their timestamp at all.
+    fn is_set(&self) -> bool {
+        self.from.is_some() || self.to.is_some() || self.slice.is_some()
+    }
+
+    /// Returns the start of the slice in which the sample with timestamp `ts` is located.
+    ///
+    /// If the sample is outside the window, the function returns `None`.
+    fn slice_of(&self, ts: u64) -> Option<u64> {
+        let from = self.from.unwrap_or(0);
+        if ts < from || self.to.is_some_and(|to| ts >= to) {
+            return None;
+        }
+        Some(self.slice.map_or(from, |width| from + (ts - from) / width * width))
+    }
 }
 
-/// A set of stacks with the associated number of occurrence for each.
-type FoldedStacks<'s> = HashMap<Vec<&'s str>, u64>;
+/// Identifies a set of CPU stacks: the vCPU they have been collected on, the start of their time
+/// slice (see [`Window`]) and the tag of their address space (zero if unknown).
+type CpuSlice = (u16, u64, u64);
+
+/// Skips a block of CPU profile data (or a record for files in the legacy format).
+///
+/// Only the header of the block or record is read, the rest is skipped.
+fn skip_cpu_data(input: &mut Input, legacy: bool) -> io::Result<()> {
+    if legacy {
+        let depth = input.u8()? as usize;
+        input.bytes(depth * size_of::<u64>())?;
+    } else {
+        input.u8()?;
+        input.varint()?;
+        let len = input.varint()?;
+        input.bytes(len as usize)?;
+    }
+    Ok(())
+}
+
+/// Returns the length of the longest prefix of `data` made of whole blocks (or whole records for
+/// files in the legacy format).
+fn complete_cpu_data(data: &[u8], legacy: bool) -> io::Result<usize> {
+    let mut input = Input::new(data);
+    let mut len = 0;
+    while !input.is_empty() {
+        match skip_cpu_data(&mut input, legacy) {
+            Ok(()) => len = data.len() - input.remaining().len(),
+            Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => break,
+            Err(e) => return Err(e),
+        }
+    }
+    Ok(len)
+}
+
+/// Splits CPU profile data into at most `count` chunks of roughly the same size, each made of whole
+/// blocks (or whole records for files in the legacy format), so that they can be folded
+/// independently.
+fn split_cpu_data(data: &[u8], legacy: bool, count: usize) -> io::Result<Vec<&[u8]>> {
+    let target = data.len().div_ceil(count).max(1);
+    let mut chunks = Vec::with_capacity(count);
+    let mut input = Input::new(data);
+    let mut start = data;
+    while !input.is_empty() {
+        skip_cpu_data(&mut input, legacy)?;
+        let len = start.len() - input.remaining().len();
+        if len >= target || input.is_empty() {
+            chunks.push(&start[..len]);
+            start = input.remaining();
+        }
+    }
+    Ok(chunks)
+}
 
 /// Count the number of identical stacks.
 ///
-/// The function returns a hashmap with each stack associated with its number of occurrences.
-fn fold_stacks_cpu(iter: Bytes<BufReader<File>>, symbols: &[Symbol]) -> io::Result<FoldedStacks> {
-    let mut iter = iter.peekable();
-    let mut folded_stacks: FoldedStacks = HashMap::new();
-    while iter.peek().is_some() {
-        let mut frames = stack_iter(&mut iter, symbols)?.peekable();
-        // Subdivide stack into substacks (interruptions handling)
-        while frames.peek().is_some() {
-            let substack: Vec<_> = frames
-                .by_ref()
-                .take_while(Option::is_some)
-                .map(|f| f.unwrap())
-                .collect();
-            if substack.is_empty() {
-                continue;
+/// `data` is the content of the file after the header. `header` is the header of the file, or
+/// `None` if the file is in the legacy format. Stacks already folded by the plugin are accepted
+/// as well. Samples are selected according to `window`, which requires the profile to have
+/// timestamps.
+///
+/// The data is split into chunks, each folded on its own thread among `jobs`. Results are then
+/// merged.
+///
+/// For each vCPU and time slice, the function returns a hashmap with each stack associated with
+/// its number of occurrences. Frames are not resolved.
+fn fold_stacks_cpu(
+    data: &[u8],
+    header: Option<&Header>,
+    window: &Window,
+    jobs: usize,
+) -> io::Result<HashMap<CpuSlice, RawStacks>> {
+    let chunks = split_cpu_data(data, header.is_none(), jobs)?;
+    let results = thread::scope(|scope| {
+        let workers: Vec<_> = chunks
+            .into_iter()
+            .map(|chunk| {
+                scope.spawn(move || match header {
+                    Some(header) => fold_chunk_cpu(Input::new(chunk), header, window),
+                    None => fold_chunk_cpu_legacy(Input::new(chunk)),
+                })
+            })
+            .collect();
+        workers
+            .into_iter()
+            .map(|w| w.join().unwrap())
+            .collect::<io::Result<Vec<_>>>()
+    })?;
+    let mut results = results.into_iter();
+    let mut cpus = results.next().unwrap_or_default();
+    for result in results {
+        for (key, stacks) in result {
+            merge_stacks(cpus.entry(key).or_default(), stacks);
+        }
+    }
+    Ok(cpus)
+}
+
+/// Same as [`fold_stacks_cpu`], for a chunk of blocks, on the current thread.
+fn fold_chunk_cpu(
+    mut input: Input,
+    header: &Header,
+    window: &Window,
+) -> io::Result<HashMap<CpuSlice, RawStacks>> {
+    let aggregated = header.flags & FLAG_AGGREGATED != 0;
+    let timestamps = header.flags & FLAG_TIMESTAMPS != 0;
+    let address_spaces = header.flags & FLAG_ADDRESS_SPACES != 0;
+    let contexts = header.flags & FLAG_CONTEXTS != 0;
+    let mut cpus: HashMap<CpuSlice, RawStacks> = HashMap::new();
+    let mut frames = Vec::new();
+    while !input.is_empty() {
+        let tag = input.u8()?;
+        let cpu = input.varint()?;
+        let len = input.varint()?;
+        let payload = input.bytes(len as usize)?;
+        // Compressed blocks hold whole blocks, folded as if they were a chunk of their own
+        if tag == format::BLOCK_ZSTD || tag == format::BLOCK_LZ4 {
+            let data = compress::decompress(tag, cpu as usize, payload)?;
+            for (key, stacks) in fold_chunk_cpu(Input::new(&data), header, window)? {
+                merge_stacks(cpus.entry(key).or_default(), stacks);
             }
-            // Increment counter
-            *folded_stacks.entry(substack).or_insert(0) += 1;
+            continue;
+        }
+        if tag != format::BLOCK_SAMPLES && tag != format::BLOCK_STATS {
+            return Err(format::invalid_data(format!("invalid block tag `{tag}`")));
+        }
+        let cpu = cpu as u16;
+        let mut payload = Input::new(payload);
+        // Counters are read separately (see `read_stats`)
+        if tag == format::BLOCK_STATS {
+            continue;
+        }
+        let mut ts = 0;
+        let mut asid = 0u64;
+        while !payload.is_empty() {
+            if timestamps {
+                ts += payload.varint()?;
+            }
+            if address_spaces {
+                asid = asid.wrapping_add(format::unzigzag(payload.varint()?) as u64);
+            }
+            let boundaries = if contexts { payload.varint()? } else { 0 };
+            let depth = payload.varint()?;
+            let count = if aggregated { payload.varint()? } else { 1 };
+            // Each frame is relative to the previous one
+            frames.clear();
+            let mut addr = header.base;
+            for i in 0..depth {
+                let delta = format::unzigzag(payload.varint()?);
+                addr = addr.wrapping_add(delta as u64);
+                if i < 64 && boundaries >> i & 1 != 0 {
+                    frames.push(CONTEXT_BOUNDARY);
+                }
+                frames.push(addr);
+            }
+            let Some(slice) = window.slice_of(ts) else {
+                continue;
+            };
+            fold_raw(cpus.entry((cpu, slice, asid)).or_default(), &frames, count);
+        }
+    }
+    Ok(cpus)
+}
+
+/// Same as [`fold_chunk_cpu`], for files in the legacy format: each record is the depth of the
+/// stack (`u8`) followed by its frames (`u64`). Samples have no timestamps and are attributed to
+/// the vCPU `0`.
+fn fold_chunk_cpu_legacy(mut input: Input) -> io::Result<HashMap<CpuSlice, RawStacks>> {
+    let mut cpus: HashMap<CpuSlice, RawStacks> = HashMap::new();
+    let mut frames = Vec::new();
+    while !input.is_empty() {
+        let depth = input.u8()?;
+        frames.clear();
+        frames.extend(input.frames(depth as usize)?);
+        fold_raw(cpus.entry((0, 0, 0)).or_default(), &frames, 1);
+    }
+    Ok(cpus)
+}
+
+/// Returns the prefix of the names of output files for the CPU profile with the given header:
+/// `access` for profiles of memory accesses, or `cpu`.
+fn cpu_graph_prefix(header: Option<&Header>) -> &'static str {
+    match header.map(|h| h.sample_mode) {
+        Some(SampleMode::Accesses) => "access",
+        _ => "cpu",
+    }
+}
+
+/// Returns the name of the output file for the stacks of the given vCPU (or all of them if `None`)
+/// and time slice, with the given prefix (see [`cpu_graph_prefix`]).
+fn cpu_graph_name(prefix: &str, cpu: Option<u16>, slice: u64, window: &Window) -> String {
+    let cpu = cpu.map(|cpu| format!("-{cpu}")).unwrap_or_default();
+    if window.slice.is_some() {
+        format!("{prefix}{cpu}-t{slice}.svg")
+    } else {
+        format!("{prefix}{cpu}.svg")
+    }
+}
+
+/// Resolves CPU stacks and adds them to the graph they belong to in `graphs`, by output file name
+/// (see [`cpu_graph_name`]). Unless `per_cpu` is set, the stacks of all vCPUs are merged.
+fn add_cpu_stacks(
+    graphs: &mut HashMap<String, CallTree>,
+    cpus: HashMap<CpuSlice, RawStacks>,
+    prefix: &str,
+    per_cpu: bool,
+    window: &Window,
+    resolver: &mut Resolver,
+) {
+    // Merge raw stacks as needed before resolving them, which is cheaper
+    let mut merged: HashMap<(String, u64), RawStacks> = HashMap::new();
+    for ((cpu, slice, asid), stacks) in cpus {
+        let name = cpu_graph_name(prefix, per_cpu.then_some(cpu), slice, window);
+        merge_stacks(merged.entry((name, asid)).or_default(), stacks);
+    }
+    for ((name, asid), stacks) in merged {
+        resolver.resolve_stacks(graphs.entry(name).or_default(), asid, stacks);
+    }
+    // Write an empty graph rather than nothing
+    if graphs.is_empty() && !per_cpu {
+        let name = cpu_graph_name(prefix, None, window.from.unwrap_or(0), window);
+        graphs.insert(name, CallTree::default());
+    }
+}
+
+/// Statistics of the allocations made by a stack.
+#[derive(Default)]
+struct StackStats {
+    /// The net amount of memory allocated.
+    net: u64,
+    /// The value of `net` at the last peak of the allocator, if `peak_epoch` is the last peak.
+    /// Otherwise, `net` has not changed since the last peak.
+    peak_net: u64,
+    /// The peak at which `peak_net` has been saved.
+    peak_epoch: u64,
+    /// The number of allocations and reallocations.
+    allocs: u64,
+    /// The total amount of memory allocated or reallocated.
+    allocated: u64,
+}
+
+/// The state of an allocator while folding memory tracing.
+#[derive(Default)]
+struct Allocator {
+    /// The ID of each distinct stack. Frames are ordered from the innermost to the outermost.
+    stack_ids: HashMap<Vec<u32>, u32>,
+    /// The statistics of each stack, by ID.
+    stacks: Vec<StackStats>,
+    /// The stack ID and size of each live allocation, by address.
+    live: HashMap<u64, (u32, u64)>,
+    /// The total amount of live memory.
+    total: u64,
+    /// The highest value of `total` so far.
+    peak: u64,
+    /// The number of times `peak` has been raised.
+    epoch: u64,
+}
+
+impl Allocator {
+    /// Returns the ID of the given stack, allocating one if necessary.
+    fn stack_id(&mut self, frames: &[u32]) -> u32 {
+        // Avoid allocating if the stack is already present
+        if let Some(id) = self.stack_ids.get(frames) {
+            return *id;
+        }
+        let id = self.stacks.len() as u32;
+        self.stack_ids.insert(frames.to_vec(), id);
+        // The stack did not allocate anything at the last peak
+        self.stacks.push(StackStats {
+            peak_epoch: self.epoch,
+            ..Default::default()
+        });
+        id
+    }
+
+    /// Returns the statistics of the given stack, to change its net amount of memory.
+    ///
+    /// The state of all stacks at the last peak is saved lazily: each stack saves its own the first
+    /// time it changes after the peak, which keeps the cost of a new peak constant.
+    fn change(&mut self, id: u32) -> &mut StackStats {
+        let stats = &mut self.stacks[id as usize];
+        if stats.peak_epoch != self.epoch {
+            stats.peak_epoch = self.epoch;
+            stats.peak_net = stats.net;
+        }
+        stats
+    }
+
+    /// Records an allocation of `size` bytes at `ptr` by the given stack.
+    ///
+    /// If `realloc` is set and `ptr` is a live allocation, its size is changed, and it remains
+    /// accounted to the stack that allocated it first.
+    fn alloc(&mut self, ptr: u64, size: u64, frames: &[u32], realloc: bool) {
+        let old = self.live.get(&ptr).copied();
+        if let Some((id, old_size)) = old {
+            self.change(id).net -= old_size;
+            self.total -= old_size;
+        }
+        let id = match old {
+            Some((id, _)) if realloc => id,
+            _ => self.stack_id(frames),
+        };
+        let stats = self.change(id);
+        stats.net += size;
+        stats.allocs += 1;
+        stats.allocated += size;
+        self.live.insert(ptr, (id, size));
+        self.total += size;
+        if self.total > self.peak {
+            self.peak = self.total;
+            self.epoch += 1;
         }
     }
-    Ok(folded_stacks)
+
+    /// Records that the allocation at `ptr` has been freed.
+    fn free(&mut self, ptr: u64) {
+        if let Some((id, size)) = self.live.remove(&ptr) {
+            self.change(id).net -= size;
+            self.total -= size;
+        }
+    }
+}
+
+/// The views of the memory tracing of an allocator.
+struct MemoryGraphs {
+    /// The memory still allocated at the end of the trace.
+    net: CallTree,
+    /// The memory allocated when the total amount of live memory was the highest.
+    peak: CallTree,
+    /// The number of allocations.
+    churn: CallTree,
+    /// The total amount of memory allocated.
+    churn_bytes: CallTree,
 }
 
-/// Counts **net** allocated memory for each stack.
+/// Counts allocated memory for each stack.
+///
+/// Stacks are interned as soon as they are read and allocations are forgotten when freed, so that
+/// the memory used is bounded by the number of live allocations and distinct stacks, regardless of
+/// the length of the trace.
 ///
-/// For each allocator, the function returns a hashmap with each stack associated with the quantity of allocated memory.
+/// For each allocator, the function returns the views of its allocations (see [`MemoryGraphs`]).
 fn fold_stacks_memory(
-    iter: Bytes<BufReader<File>>,
-    symbols: &[Symbol],
-) -> io::Result<HashMap<String, FoldedStacks>> {
-    let mut iter = iter.peekable();
-    let mut allocators: HashMap<String, HashMap<u64, (Vec<&str>, u64)>> = HashMap::new();
-    while let Some(alloc_name_len) = iter.next() {
-        let alloc_name_len = alloc_name_len? as usize;
-        let name = iter
-            .by_ref()
-            .take(alloc_name_len)
-            .map(|c| c.map(char::from))
-            .collect::<io::Result<String>>()?;
-        let Some(op) = iter.next().transpose()? else {
-            break;
-        };
-        let Some(ptr) = next_u64(&mut iter)? else {
-            break;
-        };
-        let Some(size) = next_u64(&mut iter)? else {
-            break;
-        };
-        let frames = stack_iter(&mut iter, symbols)?
-            .map(|s| s.unwrap_or("???"))
-            .collect();
+    mut input: Input,
+    resolver: &mut Resolver,
+) -> io::Result<HashMap<String, MemoryGraphs>> {
+    let mut allocators: HashMap<&[u8], Allocator> = HashMap::new();
+    let mut cache: HashMap<u64, u32> = HashMap::new();
+    let mut frames = Vec::new();
+    while !input.is_empty() {
+        let alloc_name_len = input.u8()? as usize;
+        let name = input.bytes(alloc_name_len)?;
+        let op = input.u8()?;
+        let ptr = input.u64()?;
+        let size = input.u64()?;
+        let stack_depth = input.u8()? as usize;
+        let stack = input.frames(stack_depth)?;
         // Update
-        let entry = allocators.entry(name).or_insert(HashMap::new());
-        let alloc = entry.entry(ptr).or_insert((frames, 0));
+        let allocator = allocators.entry(name).or_default();
         match op {
             // Allocate or reallocate
-            0 | 1 => alloc.1 = size,
+            0 | 1 => {
+                frames.clear();
+                frames.extend(stack.map(|addr| {
+                    *cache.entry(addr).or_insert_with(|| {
+                        let name = resolver.lookup(0, addr).unwrap_or("???");
+                        resolver.names.intern(name)
+                    })
+                }));
+                allocator.alloc(ptr, size, &frames, op == 1);
+            }
             // Free
-            2 => alloc.1 = 0,
-            opcode => panic!("Invalid opcode `{opcode}`"),
+            2 => allocator.free(ptr),
+            opcode => return Err(format::invalid_data(format!("invalid opcode `{opcode}`"))),
         }
     }
     // Fold stacks
     Ok(allocators
         .into_iter()
-        .map(|(allocator, allocations)| {
-            let mut stacks = HashMap::new();
-            for (_, (stack, size)) in allocations {
-                *stacks.entry(stack).or_insert(0) += size;
+        .map(|(name, allocator)| {
+            let mut graphs = MemoryGraphs {
+                net: CallTree::default(),
+                peak: CallTree::default(),
+                churn: CallTree::default(),
+                churn_bytes: CallTree::default(),
+            };
+            for (stack, id) in allocator.stack_ids {
+                let stats = &allocator.stacks[id as usize];
+                let peak = if stats.peak_epoch == allocator.epoch {
+                    stats.peak_net
+                } else {
+                    stats.net
+                };
+                let frames = || stack.iter().rev().copied();
+                graphs.net.add(frames(), stats.net);
+                graphs.peak.add(frames(), peak);
+                graphs.churn.add(frames(), stats.allocs);
+                graphs.churn_bytes.add(frames(), stats.allocated);
             }
-            (allocator, stacks)
+            (name.iter().copied().map(char::from).collect(), graphs)
         })
         .collect())
 }
 
+/// The way graphs are written.
+#[derive(Clone, Copy)]
+enum GraphOutput<'a> {
+    /// FlameGraphs in SVG, rendered with the built-in renderer.
+    Svg,
+    /// FlameGraphs in SVG, rendered by piping folded stacks into the given script, as with
+    /// `flamegraph.pl`.
+    Script(&'a str),
+    /// Folded stacks, in the format accepted by `flamegraph.pl`.
+    Folded,
+    /// Gzipped pprof protocol buffers (see [`pprof`]).
+    Pprof,
+}
+
+impl GraphOutput<'_> {
+    /// Returns the extension of output files.
+    fn extension(self) -> &'static str {
+        match self {
+            Self::Svg | Self::Script(_) => "svg",
+            Self::Folded => "folded",
+            Self::Pprof => "pb.gz",
+        }
+    }
+}
+
+/// Writes the graph of `tree` at `path`, in the format given by `output`. `count_name` is the
+/// unit of counts.
+fn write_graph(
+    path: &Path,
+    title: &str,
+    tree: &CallTree,
+    names: &FrameNames,
+    alloc: bool,
+    count_name: &str,
+    output: GraphOutput,
+) -> io::Result<()> {
+    let file = File::create(path)?;
+    let script = match output {
+        GraphOutput::Svg => None,
+        GraphOutput::Script(script) => Some(script),
+        GraphOutput::Folded => {
+            let mut writer = BufWriter::new(file);
+            tree.write_folded(names, &mut writer)?;
+            return writer.flush();
+        }
+        GraphOutput::Pprof => {
+            let mut writer = BufWriter::new(file);
+            pprof::write(tree, names, count_name, &mut writer)?;
+            return writer.flush();
+        }
+    };
+    let Some(script) = script else {
+        let options = flamegraph::Options {
+            title,
+            count_name,
+            palette: if alloc { Palette::Mem } else { Palette::Hot },
+            deltas: None,
+        };
+        let mut writer = BufWriter::new(file);
+        flamegraph::write_svg(tree, names, &options, &mut writer)?;
+        return writer.flush();
+    };
+    let colors: &[&str] = if alloc { &["--colors", "mem"] } else { &[] };
+    run_script(script, colors, count_name, file, |w| tree.write_folded(names, w))
+}
+
+/// Writes the differential FlameGraph of `new` against `base` at `path` (see [`diff`]).
+///
+/// `output` is the same as for [`write_graph`]. The pprof format cannot hold two counts per
+/// stack, so it is not supported.
+fn write_diff_graph(
+    path: &Path,
+    base: &CallTree,
+    new: &CallTree,
+    names: &FrameNames,
+    output: GraphOutput,
+) -> io::Result<()> {
+    let file = File::create(path)?;
+    let script = match output {
+        GraphOutput::Svg => None,
+        GraphOutput::Script(script) => Some(script),
+        GraphOutput::Folded => {
+            let mut writer = BufWriter::new(file);
+            diff::write_folded(base, new, names, &mut writer)?;
+            return writer.flush();
+        }
+        GraphOutput::Pprof => unreachable!(),
+    };
+    let Some(script) = script else {
+        let deltas = diff::node_deltas(base, new);
+        let options = flamegraph::Options {
+            title: "diff",
+            count_name: "samples",
+            palette: Palette::Hot,
+            deltas: Some(&deltas),
+        };
+        let mut writer = BufWriter::new(file);
+        flamegraph::write_svg(new, names, &options, &mut writer)?;
+        return writer.flush();
+    };
+    run_script(script, &[], "samples", file, |w| diff::write_folded(base, new, names, w))
+}
+
+/// Renders a graph by running `script` with the given arguments and piping into it the folded
+/// stacks written by `write`. The graph is written to `output`.
+fn run_script<F: FnOnce(&mut BufWriter<ChildStdin>) -> io::Result<()>>(
+    script: &str,
+    args: &[&str],
+    count_name: &str,
+    output: File,
+    write: F,
+) -> io::Result<()> {
+    let mut cmd = Command::new(script);
+    cmd.args(args);
+    cmd.args(&["--countname", count_name]);
+    cmd.stdin(Stdio::piped());
+    // Redirect output to file
+    cmd.stdout(output);
+    // Run
+    let mut child = cmd.spawn()?;
+    // Serialize output
+    let mut writer = BufWriter::new(child.stdin.take().unwrap());
+    write(&mut writer)?;
+    // Close the pipe, then wait for the graph to be written
+    drop(writer.into_inner()?);
+    child.wait()?;
+    Ok(())
+}
+
+/// Reads the header of the CPU profile `data`, checks it (see [`check_header`]) and folds its
+/// stacks (see [`fold_stacks_cpu`]).
+///
+/// The function also returns the header, if any.
+fn fold_profile(
+    data: &[u8],
+    elf_build_id: Option<&[u8]>,
+    window: &Window,
+    address_spaces: bool,
+    jobs: usize,
+) -> io::Result<(Option<Header>, HashMap<CpuSlice, RawStacks>)> {
+    let mut input = Input::new(data);
+    let header = format::read_header(&mut input)?;
+    check_header(header.as_ref(), elf_build_id, window, address_spaces);
+    let cpus = fold_stacks_cpu(input.remaining(), header.as_ref(), window, jobs)?;
+    Ok((header, cpus))
+}
+
+/// Prints the tag of each address space samples have been collected in, with the number of
+/// samples, from the most sampled to the least.
+fn print_address_spaces(cpus: &HashMap<CpuSlice, RawStacks>) {
+    let mut spaces: HashMap<u64, u64> = HashMap::new();
+    for ((_, _, asid), stacks) in cpus {
+        *spaces.entry(*asid).or_insert(0) += stacks.values().sum::<u64>();
+    }
+    let mut spaces: Vec<_> = spaces.into_iter().collect();
+    spaces.sort_unstable_by(|(a1, c1), (a2, c2)| c2.cmp(c1).then(a1.cmp(a2)));
+    for (asid, count) in spaces {
+        println!("{asid:#x}\t{count}");
+    }
+}
+
+/// Returns the number of samples of each leaf address, by address space tag.
+fn leaf_counts(cpus: &HashMap<CpuSlice, RawStacks>) -> HashMap<(u64, u64), u64> {
+    let mut leaves = HashMap::new();
+    for ((_, _, asid), stacks) in cpus {
+        for (frames, count) in stacks {
+            if let Some(addr) = frames.first() {
+                *leaves.entry((*asid, *addr)).or_insert(0) += count;
+            }
+        }
+    }
+    leaves
+}
+
+/// Returns the counters of the plugin for each vCPU, found at the end of CPU profile data (see
+/// [`FLAG_STATS`]).
+fn read_stats(data: &[u8]) -> io::Result<Vec<(u16, Stats)>> {
+    let mut input = Input::new(data);
+    let mut stats = Vec::new();
+    while !input.is_empty() {
+        let tag = input.u8()?;
+        let cpu = input.varint()? as u16;
+        let len = input.varint()?;
+        let payload = Input::new(input.bytes(len as usize)?);
+        if tag == format::BLOCK_STATS {
+            stats.push((cpu, Stats::read(payload)?));
+        }
+    }
+    stats.sort_unstable_by_key(|(cpu, _)| *cpu);
+    Ok(stats)
+}
+
+/// Prints the counters of the plugin for each vCPU, then their sum.
+fn print_stats(stats: &[(u16, Stats)]) {
+    println!(
+        "{:<8}{:>12}{:>12}{:>12}{:>14}{:>14}{:>12}",
+        "vCPU", "samples", "dropped", "truncated", "read errors", "bytes", "ns/sample"
+    );
+    let print = |name: &str, s: &Stats| {
+        let per_sample = s.sample_ns.checked_div(s.samples).unwrap_or(0);
+        println!(
+            "{name:<8}{:>12}{:>12}{:>12}{:>14}{:>14}{per_sample:>12}",
+            s.samples, s.drops, s.max_depth, s.read_errors, s.bytes
+        );
+    };
+    let mut total = Stats::default();
+    for (cpu, s) in stats {
+        print(&cpu.to_string(), s);
+        total.add(s);
+    }
+    print("total", &total);
+}
+
+/// Checks that the header of a CPU profile matches the kernel's build ID and allows selecting
+/// samples according to `window`, and by address space if `address_spaces` is set. On error, the
+/// function exits.
+fn check_header(
+    header: Option<&Header>,
+    elf_build_id: Option<&[u8]>,
+    window: &Window,
+    address_spaces: bool,
+) {
+    if let Some(profile_build_id) = header.and_then(|h| h.build_id.as_ref()) {
+        if elf_build_id.is_some_and(|id| id != profile_build_id) {
+            eprintln!("warning: the profile has been recorded on a different build of the kernel");
+        }
+    }
+    if window.is_set() && !header.is_some_and(|h| h.flags & FLAG_TIMESTAMPS != 0) {
+        eprintln!("The profile does not have timestamps!");
+        exit(1);
+    }
+    if address_spaces && !header.is_some_and(|h| h.flags & FLAG_ADDRESS_SPACES != 0) {
+        eprintln!("The profile does not have address spaces!");
+        exit(1);
+    }
+}
+
+/// Parses a timestamp given on the command line. The value may have a suffix among `ns`, `us`,
+/// `ms`, `s` (for time based sampling) or `k`, `M`, `G` (for instructions or memory accesses).
+fn parse_timestamp(s: &str) -> Option<u64> {
+    const SUFFIXES: [(&str, u64); 7] = [
+        ("ns", 1),
+        ("us", 1_000),
+        ("ms", 1_000_000),
+        ("s", 1_000_000_000),
+        ("k", 1_000),
+        ("M", 1_000_000),
+        ("G", 1_000_000_000),
+    ];
+    let (num, mul) = SUFFIXES
+        .iter()
+        .find_map(|(suffix, mul)| Some((s.strip_suffix(suffix)?, *mul)))
+        .unwrap_or((s, 1));
+    num.parse::<u64>().ok()?.checked_mul(mul)
+}
+
+/// Parses the given ELF file. On error, the function exits.
+fn parse_elf(buf: &[u8]) -> ElfBytes<'_, AnyEndian> {
+    match ElfBytes::<AnyEndian>::minimal_parse(buf) {
+        Ok(elf) => elf,
+        Err(e) => {
+            eprintln!("Could not read ELF: {e}");
+            exit(1);
+        }
+    }
+}
+
+/// Prints the command's usage, then exits.
+fn usage() -> ! {
+    eprintln!("usage: kern-profile [--alloc] [--per-cpu] [--jobs <n>] [--from <ts>] [--to <ts>] [--slice <width>] [--flamegraph <script>] [--format <format>] [--follow <interval>] [--no-symbol-cache] [--image <image>]... [--address-spaces] [--diff <base profile>] [--stats] [--lines] <profile file> <elf file>");
+    eprintln!("       kern-profile --unwind-table <elf file> <output file>");
+    eprintln!();
+    eprintln!("options:");
+    eprintln!("\t--alloc: if set, the provided profile file contains memory allocator tracing. If not, it contains CPU tracing");
+    eprintln!("\t--per-cpu: if set, one Flamegraph is written for each vCPU instead of a single one for all of them (CPU tracing only)");
+    eprintln!("\t--jobs <n>: the number of threads used to fold stacks (CPU tracing only). Defaults to the number of available CPUs");
+    eprintln!("\t--from <ts>: if set, samples collected before the given timestamp are ignored (CPU tracing only)");
+    eprintln!("\t--to <ts>: if set, samples collected at or after the given timestamp are ignored (CPU tracing only)");
+    eprintln!("\t--slice <width>: if set, one Flamegraph is written for each slice of the given width, starting at `--from` (CPU tracing only)");
+    eprintln!("\t--flamegraph <script>: if set, Flamegraphs are rendered by piping folded stacks into the given script (typically `FlameGraph/flamegraph.pl`) instead of the built-in renderer");
+    eprintln!("\t--format <format>: the format of output files: `svg` for Flamegraphs (default), `folded` for folded stacks in the format accepted by `flamegraph.pl` (with `.folded` instead of `.svg`), or `pprof` for gzipped pprof protocol buffers (with `.pb.gz` instead of `.svg`, not available with `--diff`). `--flamegraph` requires `svg`");
+    eprintln!("\t--follow <interval>: if set, the profile is folded while it is being written (CPU tracing only), and Flamegraphs are refreshed at the given interval. The profile may be a FIFO");
+    eprintln!("\t--no-symbol-cache: if set, symbols (and source lines with `--lines`) are read from the ELF instead of the cache, which is not updated either");
+    eprintln!("\t--image <path>[,base=<address>][,asid=<cr3>]: resolves frames against the symbols of the given ELF as well (a kernel module or userspace program), loaded at the given address. If `asid` is set, only frames collected in the address space with the given value of CR3 are resolved against it. May be repeated");
+    eprintln!("\t--address-spaces: prints the value of CR3 of each address space samples have been collected in, with the number of samples, then exits (CPU tracing only)");
+    eprintln!("\t--diff <base profile>: compares the profile with the given baseline (CPU tracing only). A differential Flamegraph is written at `diff.svg`, where frames whose share of samples grew are red and those whose share shrank are blue, and the functions whose self share changed the most are printed");
+    eprintln!("\t--stats: prints the counters recorded by the plugin with `stats=1` for each vCPU (samples, dropped samples, stacks truncated at the maximum depth, unwinding read errors, bytes written before compression and time spent per sample), then exits (CPU tracing only)");
+    eprintln!("\t--lines: if set, frames are resolved against the source lines of the ELF files (from their DWARF debugging information) as well, so that functions inlined at each address have frames of their own, and the number of samples of each line is written at `lines.txt` (CPU tracing only)");
+    eprintln!("\t--unwind-table: writes the unwind table of the kernel to the output file, to be passed to the QEMU plugin with `unwind=<path>`");
+    eprintln!("\t<profile file>: path to the file containing samples recorded from execution");
+    eprintln!("\t<elf file>: path to the observed kernel");
+    eprintln!();
+    eprintln!("Timestamps are in nanoseconds since the plugin was loaded, in instructions executed by the vCPU if the profile has been recorded with `period`, or in memory accesses made by the vCPU with `access_period`. They may have a suffix among `ns`, `us`, `ms`, `s`, `k`, `M` and `G`.");
+    eprintln!();
+    eprintln!("On success, the command writes one or several Flamegraph(s) at `cpu.svg` (or `cpu-<vcpu>.svg` with `--per-cpu`, and `-t<slice start>` before the extension with `--slice`) for CPU tracing (`access` instead of `cpu` for profiles of memory accesses), or at `mem-<allocator>.svg` for memory tracing. Memory tracing also writes `mem-<allocator>-peak.svg` (memory allocated when the most memory was in use), `mem-<allocator>-churn.svg` (number of allocations) and `mem-<allocator>-churn-bytes.svg` (amount of memory allocated).");
+    exit(1);
+}
+
 fn main() -> io::Result<()> {
     let mut args_iter = env::args_os().peekable();
     // Skip program name
     args_iter.next();
-    let alloc = args_iter.next_if(|p| p == "--alloc").is_some();
+    let mut alloc = false;
+    let mut per_cpu = false;
+    let mut unwind_table = false;
+    let mut window = Window::default();
+    let mut jobs = thread::available_parallelism().map_or(1, NonZeroUsize::get);
+    let mut flamegraph_script = None;
+    let mut output_format = None;
+    let mut follow_interval = None;
+    let mut symbol_cache = true;
+    let mut image_specs = Vec::new();
+    let mut list_address_spaces = false;
+    let mut diff_base = None;
+    let mut show_stats = false;
+    let mut source_lines = false;
+    while let Some(opt) = args_iter.next_if(|a| a.to_str().is_some_and(|a| a.starts_with("--"))) {
+        // Returns the value of the option
+        let mut value = || {
+            args_iter
+                .next()
+                .and_then(|a| a.into_string().ok())
+                .unwrap_or_else(|| usage())
+        };
+        let mut timestamp = || parse_timestamp(&value()).unwrap_or_else(|| usage());
+        match opt.to_str().unwrap() {
+            "--alloc" => alloc = true,
+            "--per-cpu" => per_cpu = true,
+            "--unwind-table" => unwind_table = true,
+            "--flamegraph" => flamegraph_script = Some(value()),
+            "--format" => output_format = Some(value()),
+            "--no-symbol-cache" => symbol_cache = false,
+            "--image" => image_specs.push(image::parse_spec(&value()).unwrap_or_else(|| usage())),
+            "--address-spaces" => list_address_spaces = true,
+            "--diff" => diff_base = Some(value()),
+            "--stats" => show_stats = true,
+            "--lines" => source_lines = true,
+            "--follow" => follow_interval = Some(Duration::from_nanos(timestamp())),
+            "--jobs" => jobs = value().parse().ok().filter(|j| *j > 0).unwrap_or_else(|| usage()),
+            "--from" => window.from = Some(timestamp()),
+            "--to" => window.to = Some(timestamp()),
+            "--slice" => window.slice = Some(timestamp()).filter(|w| *w > 0).or_else(|| usage()),
+            _ => usage(),
+        }
+    }
     let args: Vec<OsString> = args_iter.collect();
-    let [input_path, elf_path] = &args[..] else {
-        eprintln!("usage: kern-profile [--alloc] <profile file> <elf file>");
-        eprintln!();
-        eprintln!("options:");
-        eprintln!("\t--alloc: if set, the provided profile file contains memory allocator tracing. If not, it contains CPU tracing");
-        eprintln!("\t<profile file>: path to the file containing samples recorded from execution");
-        eprintln!("\t<elf file>: path to the observed kernel");
-        eprintln!();
-        eprintln!("On success, the command writes one or several Flamegraph(s) at `cpu.svg` for CPU tracing, or at `mem-<allocator>.svg` for memory tracing.");
-        exit(1);
-    };
-
-    // Read ELF symbols
-    let symbols = match list_symbols(elf_path) {
-        Ok(s) => s,
-        Err(e) => {
-            eprintln!("Could not read ELF: {e}");
+    if unwind_table {
+        let [elf_path, output_path] = &args[..] else {
+            usage();
+        };
+        let elf_buf = fs::read(elf_path)?;
+        let elf = parse_elf(&elf_buf);
+        let mut output = BufWriter::new(File::create(output_path)?);
+        if let Err(e) = unwind::write_table(&elf, &mut output) {
+            eprintln!("Could not write unwind table: {e}");
             exit(1);
         }
+        return Ok(());
+    }
+    let [input_path, elf_path] = &args[..] else {
+        usage();
     };
-    let Some(symbols) = symbols else {
-        eprintln!("ELF does not have a symbol table!");
-        exit(1);
+    if alloc && source_lines {
+        usage();
+    }
+    let output = match (output_format.as_deref(), flamegraph_script.as_deref()) {
+        (None | Some("svg"), None) => GraphOutput::Svg,
+        (None | Some("svg"), Some(script)) => GraphOutput::Script(script),
+        (Some("folded"), None) => GraphOutput::Folded,
+        (Some("pprof"), None) if diff_base.is_none() => GraphOutput::Pprof,
+        _ => usage(),
     };
 
+    // Read ELF symbols. The kernel comes first, so that it is looked up first
+    let kernel = (PathBuf::from(elf_path), 0, None);
+    let mut images = Vec::with_capacity(1 + image_specs.len());
+    let mut elf_build_id = None;
+    for (path, bias, asid) in iter::once(kernel).chain(image_specs) {
+        match Image::load(&path, bias, asid, symbol_cache, source_lines.then_some(jobs)) {
+            Ok((image, build_id)) => {
+                if images.is_empty() {
+                    elf_build_id = build_id;
+                }
+                images.push(image);
+            }
+            Err(e) => {
+                eprintln!("Could not read ELF `{}`: {e}", path.display());
+                exit(1);
+            }
+        }
+    }
+    let elf_build_id = elf_build_id.as_deref();
+    // Address spaces are only needed to tell images of different address spaces apart
+    let address_spaces = list_address_spaces || images.iter().any(|i| i.asid.is_some());
+
+    if let Some(interval) = follow_interval {
+        if alloc {
+            usage();
+        }
+        if list_address_spaces || diff_base.is_some() || show_stats {
+            usage();
+        }
+        let options = follow::GraphOptions {
+            elf_build_id,
+            address_spaces,
+            per_cpu,
+            window: &window,
+            output,
+        };
+        let mut resolver = Resolver::new(&images, source_lines);
+        return follow::follow(Path::new(input_path), interval, &options, &mut resolver);
+    }
+
     // Read profile data
-    let input = File::open(input_path)?;
-    let reader = BufReader::new(input);
-    let iter = reader.bytes();
-    let graphs = if !alloc {
-        let folded_stacks = fold_stacks_cpu(iter, &symbols)?;
-        vec![("cpu.svg".into(), folded_stacks)]
+    let file = File::open(input_path)?;
+    // Safety: the file must not be modified while mapped
+    let data = unsafe { Mmap::map(&file)? };
+    let mut resolver = Resolver::new(&images, source_lines);
+
+    if show_stats {
+        if alloc {
+            usage();
+        }
+        let mut input = Input::new(&data);
+        let header = format::read_header(&mut input)?;
+        if !header.is_some_and(|h| h.flags & FLAG_STATS != 0) {
+            eprintln!("The profile does not have counters! Record it with `stats=1`");
+            exit(1);
+        }
+        print_stats(&read_stats(input.remaining())?);
+        return Ok(());
+    }
+
+    if let Some(base_path) = diff_base {
+        if alloc || per_cpu || window.slice.is_some() || list_address_spaces {
+            usage();
+        }
+        let base_file = File::open(base_path)?;
+        // Safety: the file must not be modified while mapped
+        let base_data = unsafe { Mmap::map(&base_file)? };
+        // Both profiles are folded at once, sharing the available threads
+        let jobs = jobs.div_ceil(2);
+        let (base_cpus, new_cpus) = thread::scope(|scope| {
+            let base = scope.spawn(|| {
+                fold_profile(&base_data, elf_build_id, &window, address_spaces, jobs)
+            });
+            let new = fold_profile(&data, elf_build_id, &window, address_spaces, jobs);
+            (base.join().unwrap(), new)
+        });
+        // Frames of both profiles are interned together, so that trees can be compared
+        let [base, new] = [base_cpus?, new_cpus?].map(|(header, cpus)| {
+            let mut tree = CallTree::default();
+            resolver.set_profile(header.as_ref());
+            for ((_, _, asid), stacks) in cpus {
+                resolver.resolve_stacks(&mut tree, asid, stacks);
+            }
+            tree
+        });
+        write_diff_graph(
+            &Path::new("diff").with_extension(output.extension()),
+            &base,
+            &new,
+            &resolver.names,
+            output,
+        )?;
+        let mut stdout = io::stdout().lock();
+        return diff::write_report(&base, &new, &resolver.names, &mut stdout);
+    }
+
+    // Each graph is written with the unit of its counts
+    let graphs: Vec<(String, &str, CallTree)> = if !alloc {
+        let (header, cpus) = fold_profile(&data, elf_build_id, &window, address_spaces, jobs)?;
+        if list_address_spaces {
+            print_address_spaces(&cpus);
+            return Ok(());
+        }
+        if source_lines {
+            let mut output = BufWriter::new(File::create("lines.txt")?);
+            lines::write_report(&images, &leaf_counts(&cpus), &mut output)?;
+            output.flush()?;
+        }
+        let mut graphs = HashMap::new();
+        let prefix = cpu_graph_prefix(header.as_ref());
+        resolver.set_profile(header.as_ref());
+        add_cpu_stacks(&mut graphs, cpus, prefix, per_cpu, &window, &mut resolver);
+        graphs
+            .into_iter()
+            .map(|(name, tree)| (name, "samples", tree))
+            .collect()
     } else {
-        let folded_stacks = fold_stacks_memory(iter, &symbols)?;
-        folded_stacks
+        let allocators = fold_stacks_memory(Input::new(&data), &mut resolver)?;
+        allocators
             .into_iter()
-            .map(|(name, stacks)| (format!("mem-{name}.svg"), stacks))
+            .flat_map(|(name, graphs)| {
+                [
+                    (format!("mem-{name}.svg"), "bytes", graphs.net),
+                    (format!("mem-{name}-peak.svg"), "bytes", graphs.peak),
+                    (format!("mem-{name}-churn.svg"), "allocations", graphs.churn),
+                    (format!("mem-{name}-churn-bytes.svg"), "bytes", graphs.churn_bytes),
+                ]
+            })
             .collect()
     };
 
     // Produce flamegraphs
-    for (output, stacks) in graphs {
-        // Run flamegraph
-        let mut cmd = Command::new("FlameGraph/flamegraph.pl");
-        if alloc {
-            cmd.args(&["--colors", "mem"]);
-        }
-        cmd.stdin(Stdio::piped());
-        // Redirect output to file
-        let file = File::create(output)?;
-        cmd.stdout(file);
-        // Run
-        let child = cmd.spawn()?;
-        // Serialize output
-        let mut writer = BufWriter::new(child.stdin.unwrap());
-        for (frames, count) in stacks {
-            let buff = frames.into_iter().rev().intersperse(";");
-            for b in buff {
-                write!(writer, "{b}")?;
+    for (name, count_name, tree) in graphs {
+        let title = name.strip_suffix(".svg").unwrap_or(&name);
+        write_graph(
+            &Path::new(&name).with_extension(output.extension()),
+            title,
+            &tree,
+            &resolver.names,
+            alloc,
+            count_name,
+            output,
+        )?;
+    }
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod benches {
+    extern crate test;
+
+    use super::*;
+    use symbols::SymbolIndex;
+    use test::{black_box, Bencher};
+
+    /// The number of samples of the synthetic CPU profile.
+    const SAMPLES: usize = 100_000;
+    /// The number of distinct stacks of the synthetic profiles.
+    const STACKS: usize = 4096;
+    /// The number of vCPUs of the synthetic CPU profile.
+    const VCPUS: u64 = 4;
+    /// The address of the kernel's code in the synthetic profiles.
+    const BASE: u64 = 0xffffffff80100000;
+
+    /// A xorshift pseudo-random generator, so that runs are comparable.
+    struct Rng(u64);
+
+    impl Rng {
+        fn next(&mut self) -> u64 {
+            self.0 ^= self.0 << 13;
+            self.0 ^= self.0 >> 7;
+            self.0 ^= self.0 << 17;
+            self.0
+        }
+    }
+
+    fn put_varint(out: &mut Vec<u8>, mut val: u64) {
+        while val >= 0x80 {
+            out.push(val as u8 | 0x80);
+            val >>= 7;
+        }
+        out.push(val as u8);
+    }
+
+    fn zigzag(val: i64) -> u64 {
+        ((val << 1) ^ (val >> 63)) as u64
+    }
+
+    /// Returns pseudo-random stacks, innermost frame first, sharing their outermost frames like
+    /// those of a kernel.
+    fn stacks() -> Vec<Vec<u64>> {
+        let mut rng = Rng(0x9e3779b97f4a7c15);
+        (0..STACKS)
+            .map(|_| {
+                let depth = 4 + rng.next() % 28;
+                (0..depth)
+                    .map(|d| BASE + (d * 0x10000) + (rng.next() % (64 >> d.min(5))) * 0x100)
+                    .collect()
+            })
+            .collect()
+    }
+
+    /// Returns the symbols covering the addresses of [`stacks`].
+    fn symbols() -> SymbolIndex {
+        let names: Vec<String> = (0..32 * 64).map(|i| format!("kernel::function{i}")).collect();
+        let syms = names
+            .iter()
+            .enumerate()
+            .map(|(i, name)| (BASE + i as u64 * 0x100, 0x100, name.as_str()))
+            .collect();
+        SymbolIndex::new(syms)
+    }
+
+    /// Returns a CPU profile: its header and the data following it.
+    ///
+    /// If `KERN_PROFILE_BENCH_CPU` is set, the profile is read from the file at that path.
+    /// Otherwise, a synthetic profile is returned, as written by the plugin with timestamps.
+    fn cpu_profile() -> (Option<Header>, Vec<u8>) {
+        if let Some(path) = env::var_os("KERN_PROFILE_BENCH_CPU") {
+            let data = fs::read(path).unwrap();
+            let mut input = Input::new(&data);
+            let header = format::read_header(&mut input).unwrap();
+            let len = data.len() - input.remaining().len();
+            return (header, data[len..].to_vec());
+        }
+        let header = Header {
+            version: format::VERSION,
+            ptr_width: 8,
+            flags: FLAG_TIMESTAMPS | FLAG_ADDRESS_SPACES,
+            sample_mode: SampleMode::Time,
+            vcpus: VCPUS as u32,
+            sample_interval: 10_000,
+            base: BASE,
+            build_id: None,
+        };
+        let stacks = stacks();
+        let mut rng = Rng(0x2545f4914f6cdd1d);
+        let mut data = Vec::new();
+        let mut payload = Vec::new();
+        let block = |data: &mut Vec<u8>, payload: &mut Vec<u8>, cpu: u64| {
+            data.push(format::BLOCK_SAMPLES);
+            put_varint(data, cpu);
+            put_varint(data, payload.len() as u64);
+            data.append(payload);
+        };
+        for block_index in 0..SAMPLES / 1024 {
+            let mut asid = 0;
+            for _ in 0..1024 {
+                // Timestamps are relative to the previous record
+                put_varint(&mut payload, 10_000 + rng.next() % 100);
+                let sample_asid = 0x1000 * (1 + rng.next() % 4);
+                put_varint(&mut payload, zigzag(sample_asid as i64 - asid as i64));
+                asid = sample_asid;
+                let stack = &stacks[rng.next() as usize % STACKS];
+                put_varint(&mut payload, stack.len() as u64);
+                let mut prev = BASE;
+                for addr in stack {
+                    put_varint(&mut payload, zigzag(addr.wrapping_sub(prev) as i64));
+                    prev = *addr;
+                }
             }
-            writeln!(writer, " {count}")?;
+            block(&mut data, &mut payload, block_index as u64 % VCPUS);
         }
+        (Some(header), data)
     }
 
-    Ok(())
+    /// Returns a memory trace.
+    ///
+    /// If `KERN_PROFILE_BENCH_MEM` is set, the trace is read from the file at that path.
+    /// Otherwise, a synthetic trace is returned, where most allocations are freed.
+    fn memory_trace() -> Vec<u8> {
+        if let Some(path) = env::var_os("KERN_PROFILE_BENCH_MEM") {
+            return fs::read(path).unwrap();
+        }
+        let stacks = stacks();
+        let mut rng = Rng(0x2545f4914f6cdd1d);
+        let mut live = Vec::new();
+        let mut data = Vec::new();
+        for i in 0..SAMPLES as u64 {
+            let free = !live.is_empty() && rng.next() % 2 == 0;
+            let (op, ptr, size) = if free {
+                let ptr = live.swap_remove(rng.next() as usize % live.len());
+                (2u8, ptr, 0)
+            } else {
+                live.push(i * 64);
+                (0, i * 64, 16 + rng.next() % 4096)
+            };
+            data.push(5);
+            data.extend_from_slice(b"buddy");
+            data.push(op);
+            data.extend_from_slice(&ptr.to_le_bytes());
+            data.extend_from_slice(&size.to_le_bytes());
+            let stack = if free {
+                &[][..]
+            } else {
+                &stacks[rng.next() as usize % STACKS][..]
+            };
+            data.push(stack.len() as u8);
+            for addr in stack {
+                data.extend_from_slice(&addr.to_le_bytes());
+            }
+        }
+        data
+    }
+
+    #[bench]
+    fn fold_cpu(b: &mut Bencher) {
+        let (header, data) = cpu_profile();
+        let window = Window::default();
+        b.iter(|| black_box(fold_stacks_cpu(&data, header.as_ref(), &window, 1).unwrap()));
+    }
+
+    #[bench]
+    fn fold_cpu_parallel(b: &mut Bencher) {
+        let (header, data) = cpu_profile();
+        let window = Window::default();
+        let jobs = thread::available_parallelism().map_or(1, NonZeroUsize::get);
+        b.iter(|| black_box(fold_stacks_cpu(&data, header.as_ref(), &window, jobs).unwrap()));
+    }
+
+    #[bench]
+    fn resolve_cpu(b: &mut Bencher) {
+        let (header, data) = cpu_profile();
+        let window = Window::default();
+        let cpus = fold_stacks_cpu(&data, header.as_ref(), &window, 1).unwrap();
+        let images = [Image {
+            symbols: symbols(),
+            bias: 0,
+            asid: None,
+            lines: None,
+        }];
+        b.iter(|| {
+            let mut resolver = Resolver::new(&images, false);
+            let mut graphs = HashMap::new();
+            add_cpu_stacks(&mut graphs, cpus.clone(), "cpu", false, &window, &mut resolver);
+            black_box(graphs)
+        });
+    }
+
+    #[bench]
+    fn fold_memory(b: &mut Bencher) {
+        let data = memory_trace();
+        let images = [Image {
+            symbols: symbols(),
+            bias: 0,
+            asid: None,
+            lines: None,
+        }];
+        b.iter(|| {
+            let mut resolver = Resolver::new(&images, false);
+            black_box(fold_stacks_memory(Input::new(&data), &mut resolver).unwrap())
+        });
+    }
 }
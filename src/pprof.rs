@@ -0,0 +1,130 @@
+//! Export of call trees in the pprof format: a gzipped `Profile` protocol buffer, as described in
+//! `profile.proto` of the pprof project.
+//!
+//! Each frame of the tree is a function, and a location of its own sharing the same ID. Names
+//! are stored once in the string table, and samples refer to locations by ID, which keeps files
+//! small. Messages are written as the tree is walked, without gathering all the stacks first.
+
+use crate::tree::{CallTree, FrameNames};
+use flate2::write::GzEncoder;
+use flate2::Compression;
+use std::collections::HashMap;
+use std::io;
+use std::io::Write;
+
+/// Field numbers of the `Profile` message.
+const PROFILE_SAMPLE_TYPE: u32 = 1;
+const PROFILE_SAMPLE: u32 = 2;
+const PROFILE_LOCATION: u32 = 4;
+const PROFILE_FUNCTION: u32 = 5;
+const PROFILE_STRING_TABLE: u32 = 6;
+
+/// Wire type of varints.
+const WIRE_VARINT: u64 = 0;
+/// Wire type of length-delimited fields.
+const WIRE_LEN: u64 = 2;
+
+/// Appends a varint to `buf`.
+fn put_varint(buf: &mut Vec<u8>, mut val: u64) {
+    while val >= 0x80 {
+        buf.push(val as u8 | 0x80);
+        val >>= 7;
+    }
+    buf.push(val as u8);
+}
+
+/// Appends a varint field to `buf`. Zero is the default value, which is not written.
+fn put_uint(buf: &mut Vec<u8>, field: u32, val: u64) {
+    if val != 0 {
+        put_varint(buf, (field as u64) << 3 | WIRE_VARINT);
+        put_varint(buf, val);
+    }
+}
+
+/// Appends a length-delimited field to `buf`.
+fn put_bytes(buf: &mut Vec<u8>, field: u32, bytes: &[u8]) {
+    put_varint(buf, (field as u64) << 3 | WIRE_LEN);
+    put_varint(buf, bytes.len() as u64);
+    buf.extend_from_slice(bytes);
+}
+
+/// Writes a length-delimited field of the top-level message to `out`.
+///
+/// `scratch` is a buffer reused across calls to avoid allocations.
+fn write_field<W: Write>(
+    out: &mut W,
+    field: u32,
+    bytes: &[u8],
+    scratch: &mut Vec<u8>,
+) -> io::Result<()> {
+    scratch.clear();
+    put_varint(scratch, (field as u64) << 3 | WIRE_LEN);
+    put_varint(scratch, bytes.len() as u64);
+    out.write_all(scratch)?;
+    out.write_all(bytes)
+}
+
+/// Writes the stacks of `tree` to `out` in the pprof format. `count_name` is the unit of counts.
+pub fn write<W: Write>(
+    tree: &CallTree,
+    names: &FrameNames,
+    count_name: &str,
+    out: &mut W,
+) -> io::Result<()> {
+    let mut out = GzEncoder::new(out, Compression::default());
+    // The string table begins with the empty string. String IDs are indices in the table
+    let mut strings = vec!["", count_name, if count_name == "bytes" { "bytes" } else { "count" }];
+    // The message being written, one of its fields, and the key of the message
+    let mut msg = Vec::new();
+    let mut field = Vec::new();
+    let mut scratch = Vec::new();
+
+    // ValueType { type, unit }
+    put_uint(&mut msg, 1, 1);
+    put_uint(&mut msg, 2, 2);
+    write_field(&mut out, PROFILE_SAMPLE_TYPE, &msg, &mut scratch)?;
+
+    // The ID of the location of each frame, allocated by order of appearance
+    let mut ids: HashMap<u32, u64> = HashMap::new();
+    tree.for_each_stack(|frames, count| {
+        // Sample { location_id (packed, innermost first), value (packed) }
+        field.clear();
+        for frame in frames.iter().rev() {
+            let next = ids.len() as u64 + 1;
+            put_varint(&mut field, *ids.entry(*frame).or_insert(next));
+        }
+        msg.clear();
+        put_bytes(&mut msg, 1, &field);
+        field.clear();
+        put_varint(&mut field, count);
+        put_bytes(&mut msg, 2, &field);
+        write_field(&mut out, PROFILE_SAMPLE, &msg, &mut scratch)
+    })?;
+
+    let mut frames: Vec<(u32, u64)> = ids.into_iter().collect();
+    frames.sort_unstable_by_key(|(_, id)| *id);
+    for (_, id) in &frames {
+        // Location { id, line: Line { function_id } }
+        field.clear();
+        put_uint(&mut field, 1, *id);
+        msg.clear();
+        put_uint(&mut msg, 1, *id);
+        put_bytes(&mut msg, 4, &field);
+        write_field(&mut out, PROFILE_LOCATION, &msg, &mut scratch)?;
+    }
+    for (frame, id) in &frames {
+        // Function { id, name, system_name }
+        let name = strings.len() as u64;
+        strings.push(names.get(*frame));
+        msg.clear();
+        put_uint(&mut msg, 1, *id);
+        put_uint(&mut msg, 2, name);
+        put_uint(&mut msg, 3, name);
+        write_field(&mut out, PROFILE_FUNCTION, &msg, &mut scratch)?;
+    }
+    for s in strings {
+        write_field(&mut out, PROFILE_STRING_TABLE, s.as_bytes(), &mut scratch)?;
+    }
+    out.finish()?;
+    Ok(())
+}
@@ -0,0 +1,443 @@
+//! Index of the symbols of the kernel, to resolve addresses to function names.
+//!
+//! The index is laid out for lookups: start and end addresses are stored in their own contiguous
+//! arrays, names are stored in a single arena, and a table of buckets narrows down the binary
+//! search to the few symbols located around the address, so that a lookup only touches one or
+//! two cache lines of each array.
+//!
+//! Names are stored mangled, and only demangled the first time they are looked up, since a
+//! profile only hits a small fraction of the symbols of the kernel.
+//!
+//! All the arrays are stored in a single buffer, which is also the content of cache files, so
+//! that an index saved once can be mapped back in memory instead of parsing the ELF again. The
+//! buffer begins with a header (see [`HEADER_SIZE`]), followed by the arrays in this order: start
+//! addresses (`u64`), end addresses (`u64`), offsets of names (`u32`), buckets (`u32`) and the
+//! names arena. Values are in the host's byte order.
+
+use anyhow::Result;
+use elf::endian::AnyEndian;
+use elf::ElfBytes;
+use memmap2::Mmap;
+use rustc_demangle::demangle;
+use std::cell::OnceCell;
+use std::fs;
+use std::fs::File;
+use std::io;
+use std::io::Write;
+use std::mem::{size_of, size_of_val};
+use std::path::Path;
+use std::slice;
+use std::str;
+
+/// The minimum size of the range of addresses covered by a bucket, as a power of two.
+const MIN_BUCKET_SHIFT: u32 = 12;
+
+/// The magic number at the beginning of cache files.
+const MAGIC: [u8; 4] = *b"\x7fKPS";
+/// The version of the layout of the buffer.
+const VERSION: u16 = 1;
+/// The size of the header of the buffer: magic number, version (`u16`), padding (`u16`), number
+/// of symbols (`u32`), bucket shift (`u32`), base address of buckets (`u64`), number of elements
+/// of the buckets table (`u32`), size of the names arena (`u32`).
+const HEADER_SIZE: usize = 32;
+
+/// Returns an error for an invalid cache file.
+fn invalid_cache() -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, "invalid symbol cache")
+}
+
+/// The buffer holding an index.
+enum Storage {
+    /// Built in memory. Stored as `u64` to guarantee alignment.
+    Owned(Vec<u64>),
+    /// Mapped from a cache file.
+    Mapped(Mmap),
+}
+
+impl Storage {
+    fn bytes(&self) -> &[u8] {
+        match self {
+            // Safety: any `u64` is a valid sequence of bytes
+            Self::Owned(buf) => unsafe {
+                slice::from_raw_parts(buf.as_ptr() as *const u8, size_of_val(&buf[..]))
+            },
+            Self::Mapped(map) => map,
+        }
+    }
+}
+
+/// The location of the arrays of an index in its buffer, in bytes.
+struct Layout {
+    /// The number of symbols.
+    count: usize,
+    /// The number of elements of the buckets table.
+    buckets_len: usize,
+    addrs: usize,
+    ends: usize,
+    name_offs: usize,
+    buckets: usize,
+    names: usize,
+    /// The total size of the buffer.
+    size: usize,
+}
+
+impl Layout {
+    fn new(count: usize, buckets_len: usize, names_len: usize) -> Self {
+        let addrs = HEADER_SIZE;
+        let ends = addrs + count * size_of::<u64>();
+        let name_offs = ends + count * size_of::<u64>();
+        let buckets = name_offs + (count + 1) * size_of::<u32>();
+        let names = buckets + buckets_len * size_of::<u32>();
+        Self {
+            count,
+            buckets_len,
+            addrs,
+            ends,
+            name_offs,
+            buckets,
+            names,
+            size: names + names_len,
+        }
+    }
+}
+
+/// Copies `values` into `buf` at offset `off`.
+fn put<T: Copy>(buf: &mut [u8], off: usize, values: &[T]) {
+    // Safety: only used with integers, which do not have padding
+    let bytes = unsafe { slice::from_raw_parts(values.as_ptr() as *const u8, size_of_val(values)) };
+    buf[off..off + bytes.len()].copy_from_slice(bytes);
+}
+
+/// Symbols sorted by address, without overlaps.
+pub struct SymbolIndex {
+    /// The buffer holding the arrays.
+    storage: Storage,
+    /// The location of the arrays in `storage`.
+    layout: Layout,
+
+    /// The address the first bucket begins at.
+    buckets_base: u64,
+    /// The size of the range of addresses covered by a bucket, as a power of two.
+    bucket_shift: u32,
+
+    /// The demangled name of each symbol, once it has been looked up.
+    demangled: Vec<OnceCell<Box<str>>>,
+}
+
+impl SymbolIndex {
+    /// Builds the index from the symbol table of the ELF.
+    ///
+    /// If no symbol table is present, the function returns `None`.
+    pub fn from_elf(elf: &ElfBytes<AnyEndian>) -> Result<Option<Self>> {
+        let Some((symbol_table, string_table)) = elf.symbol_table()? else {
+            return Ok(None);
+        };
+        let syms = symbol_table
+            .iter()
+            .map(|sym| Ok((sym.st_value, sym.st_size, string_table.get(sym.st_name as _)?)))
+            .collect::<Result<Vec<_>>>()?;
+        Ok(Some(Self::new(syms)))
+    }
+
+    /// Builds the index from a list of `(address, size, mangled name)`.
+    ///
+    /// Symbols without size are ignored. When symbols overlap, the first one is kept, and the
+    /// following one only covers what is left of it.
+    pub fn new(mut syms: Vec<(u64, u64, &str)>) -> Self {
+        syms.retain(|(_, size, _)| *size > 0);
+        // For a given address, larger symbols come first
+        syms.sort_unstable_by(|(a1, s1, _), (a2, s2, _)| a1.cmp(a2).then(s2.cmp(s1)));
+        let mut addrs = Vec::with_capacity(syms.len());
+        let mut ends: Vec<u64> = Vec::with_capacity(syms.len());
+        let mut name_offs = Vec::with_capacity(syms.len() + 1);
+        let mut names = String::new();
+        for (addr, size, name) in syms {
+            let mut addr = addr;
+            let end = addr.saturating_add(size);
+            if let Some(last_end) = ends.last().copied() {
+                if end <= last_end {
+                    // Contained in the previous symbol (or alias of it)
+                    continue;
+                }
+                addr = addr.max(last_end);
+            }
+            addrs.push(addr);
+            ends.push(end);
+            name_offs.push(names.len() as u32);
+            names.push_str(name);
+        }
+        name_offs.push(names.len() as u32);
+        let (buckets_base, bucket_shift, buckets) = build_buckets(&addrs, &ends);
+
+        // Serialize into the buffer
+        let layout = Layout::new(addrs.len(), buckets.len(), names.len());
+        let mut storage = vec![0u64; layout.size.div_ceil(size_of::<u64>())];
+        // Safety: any sequence of bytes is a valid `u64`
+        let buf = unsafe {
+            slice::from_raw_parts_mut(storage.as_mut_ptr() as *mut u8, size_of_val(&storage[..]))
+        };
+        buf[..4].copy_from_slice(&MAGIC);
+        put(buf, 4, &[VERSION]);
+        put(buf, 8, &[addrs.len() as u32, bucket_shift]);
+        put(buf, 16, &[buckets_base]);
+        put(buf, 24, &[buckets.len() as u32, names.len() as u32]);
+        put(buf, layout.addrs, &addrs);
+        put(buf, layout.ends, &ends);
+        put(buf, layout.name_offs, &name_offs);
+        put(buf, layout.buckets, &buckets);
+        put(buf, layout.names, names.as_bytes());
+        Self {
+            demangled: (0..layout.count).map(|_| OnceCell::new()).collect(),
+            storage: Storage::Owned(storage),
+            layout,
+            buckets_base,
+            bucket_shift,
+        }
+    }
+
+    /// Loads an index previously saved with [`Self::save`].
+    ///
+    /// If the file is not a valid cache file, the function returns an error of kind
+    /// [`io::ErrorKind::InvalidData`].
+    pub fn load(path: &Path) -> io::Result<Self> {
+        let file = File::open(path)?;
+        // Safety: cache files are only replaced through a rename, never modified in place
+        let map = unsafe { Mmap::map(&file)? };
+        let header = map.get(..HEADER_SIZE).ok_or_else(invalid_cache)?;
+        let u32_at = |off: usize| u32::from_ne_bytes(header[off..off + 4].try_into().unwrap());
+        if header[..4] != MAGIC || u16::from_ne_bytes([header[4], header[5]]) != VERSION {
+            return Err(invalid_cache());
+        }
+        let count = u32_at(8) as usize;
+        let bucket_shift = u32_at(12);
+        let buckets_base = u64::from_ne_bytes(header[16..24].try_into().unwrap());
+        let layout = Layout::new(count, u32_at(24) as usize, u32_at(28) as usize);
+        if map.len() < layout.size
+            || map.as_ptr() as usize % size_of::<u64>() != 0
+            || layout.buckets_len == 0
+            || bucket_shift >= u64::BITS
+        {
+            return Err(invalid_cache());
+        }
+        let index = Self {
+            demangled: (0..count).map(|_| OnceCell::new()).collect(),
+            storage: Storage::Mapped(map),
+            layout,
+            buckets_base,
+            bucket_shift,
+        };
+        // Check references, so that lookups cannot go out of bounds
+        let names = &index.storage.bytes()[index.layout.names..index.layout.size];
+        let names = str::from_utf8(names).map_err(|_| invalid_cache())?;
+        let name_offs = index.name_offs();
+        let buckets = index.buckets();
+        let valid = name_offs.windows(2).all(|w| w[0] <= w[1])
+            && name_offs.last().is_some_and(|o| *o as usize == names.len())
+            && name_offs.iter().all(|o| names.is_char_boundary(*o as usize))
+            && buckets.windows(2).all(|w| w[0] <= w[1])
+            && buckets.last().is_some_and(|b| *b as usize == count);
+        if !valid {
+            return Err(invalid_cache());
+        }
+        Ok(index)
+    }
+
+    /// Saves the index at `path`, to be loaded with [`Self::load`].
+    ///
+    /// The file is written next to its destination first, then renamed, so that an index being
+    /// saved is never seen partially written.
+    pub fn save(&self, path: &Path) -> io::Result<()> {
+        let tmp = path.with_extension(format!("tmp{}", std::process::id()));
+        let mut file = File::create(&tmp)?;
+        file.write_all(&self.storage.bytes()[..self.layout.size])?;
+        drop(file);
+        fs::rename(tmp, path)
+    }
+
+    /// Returns the `u64` array of `len` elements at offset `off` of the buffer.
+    fn u64s(&self, off: usize, len: usize) -> &[u64] {
+        let bytes = &self.storage.bytes()[off..off + len * size_of::<u64>()];
+        // Safety: the buffer is aligned on `u64`, and so are the offsets of `u64` arrays
+        unsafe { slice::from_raw_parts(bytes.as_ptr() as *const u64, len) }
+    }
+
+    /// Returns the `u32` array of `len` elements at offset `off` of the buffer.
+    fn u32s(&self, off: usize, len: usize) -> &[u32] {
+        let bytes = &self.storage.bytes()[off..off + len * size_of::<u32>()];
+        // Safety: the buffer is aligned on `u64`, and the offsets of `u32` arrays on `u32`
+        unsafe { slice::from_raw_parts(bytes.as_ptr() as *const u32, len) }
+    }
+
+    /// Returns the start address of each symbol.
+    fn addrs(&self) -> &[u64] {
+        self.u64s(self.layout.addrs, self.layout.count)
+    }
+
+    /// Returns the end address (exclusive) of each symbol.
+    fn ends(&self) -> &[u64] {
+        self.u64s(self.layout.ends, self.layout.count)
+    }
+
+    /// Returns the offset of the name of each symbol in the arena. The last element is the end of
+    /// the last name.
+    fn name_offs(&self) -> &[u32] {
+        self.u32s(self.layout.name_offs, self.layout.count + 1)
+    }
+
+    /// Returns, for each bucket, the index of the first symbol starting at or after the beginning
+    /// of the bucket. The last element is the number of symbols.
+    fn buckets(&self) -> &[u32] {
+        self.u32s(self.layout.buckets, self.layout.buckets_len)
+    }
+
+    /// Returns the number of symbols in the index.
+    #[allow(dead_code)]
+    pub fn len(&self) -> usize {
+        self.layout.count
+    }
+
+    /// Returns the index of the symbol in which the address is located.
+    pub fn find(&self, addr: u64) -> Option<usize> {
+        let off = addr.checked_sub(self.buckets_base)?;
+        let bucket = (off >> self.bucket_shift) as usize;
+        let buckets = self.buckets();
+        if bucket + 1 >= buckets.len() {
+            return None;
+        }
+        // The symbol starts either in the bucket, or is the last one before it
+        let start = (buckets[bucket] as usize).saturating_sub(1);
+        let end = buckets[bucket + 1] as usize;
+        let i = start + self.addrs()[start..end].partition_point(|a| *a <= addr);
+        let i = i.checked_sub(1)?;
+        (addr < self.ends()[i]).then_some(i)
+    }
+
+    /// Returns the mangled name of the symbol with the given index.
+    fn mangled_name(&self, index: usize) -> &str {
+        let name_offs = self.name_offs();
+        let (start, end) = (name_offs[index] as usize, name_offs[index + 1] as usize);
+        let names = &self.storage.bytes()[self.layout.names..self.layout.size];
+        // Safety: the arena is valid UTF-8 and names begin and end on character boundaries, which
+        // `Self::load` checks for cache files
+        unsafe { str::from_utf8_unchecked(&names[start..end]) }
+    }
+
+    /// Returns the name of the symbol with the given index, demangled.
+    pub fn name(&self, index: usize) -> &str {
+        self.demangled[index].get_or_init(|| format!("{:#}", demangle(self.mangled_name(index))).into())
+    }
+
+    /// Returns the name of the symbol in which the address is located.
+    pub fn lookup(&self, addr: u64) -> Option<&str> {
+        self.find(addr).map(|i| self.name(i))
+    }
+}
+
+/// Builds the buckets table for symbols with the given start and end addresses, with about one
+/// bucket per symbol.
+///
+/// The function returns the base address of the table, the size of the range covered by a bucket
+/// as a power of two, and the table itself.
+fn build_buckets(addrs: &[u64], ends: &[u64]) -> (u64, u32, Vec<u32>) {
+    let (Some(first), Some(last)) = (addrs.first(), ends.last()) else {
+        return (0, MIN_BUCKET_SHIFT, vec![0]);
+    };
+    let range = last - first;
+    let per_symbol = range / addrs.len() as u64;
+    let shift = (u64::BITS - per_symbol.leading_zeros()).max(MIN_BUCKET_SHIFT);
+    let count = (range >> shift) as usize + 1;
+    let mut buckets = Vec::with_capacity(count + 1);
+    let mut sym = 0;
+    for bucket in 0..count as u64 {
+        let start = first + (bucket << shift);
+        while sym < addrs.len() && addrs[sym] < start {
+            sym += 1;
+        }
+        buckets.push(sym as u32);
+    }
+    buckets.push(addrs.len() as u32);
+    (*first, shift, buckets)
+}
+
+#[cfg(test)]
+mod benches {
+    extern crate test;
+
+    use super::*;
+    use std::cmp::Ordering;
+    use test::{black_box, Bencher};
+
+    /// The number of symbols of the benchmarked index.
+    const SYMBOLS: u64 = 100_000;
+
+    /// Returns pseudo-random symbols, as found in a kernel.
+    fn symbols() -> Vec<(u64, u64, String)> {
+        let mut seed = 0x9e3779b97f4a7c15u64;
+        let mut addr = 0xffffffff80100000;
+        (0..SYMBOLS)
+            .map(|i| {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                let size = 16 + seed % 2048;
+                let sym = (addr, size, format!("kernel::module{}::function{i}", i % 97));
+                addr += size + seed % 64;
+                sym
+            })
+            .collect()
+    }
+
+    /// Returns pseudo-random addresses in the range covered by `syms`.
+    fn addresses(syms: &[(u64, u64, String)]) -> Vec<u64> {
+        let first = syms.first().unwrap().0;
+        let range = syms.last().unwrap().0 - first;
+        (0..4096u64)
+            .map(|i| first + i.wrapping_mul(0x9e3779b97f4a7c15) % range)
+            .collect()
+    }
+
+    #[bench]
+    fn lookup_index(b: &mut Bencher) {
+        let syms = symbols();
+        let addrs = addresses(&syms);
+        let index = SymbolIndex::new(syms.iter().map(|(a, s, n)| (*a, *s, n.as_str())).collect());
+        b.iter(|| {
+            for addr in &addrs {
+                black_box(index.lookup(*addr));
+            }
+        });
+    }
+
+    /// Baseline: binary search over an array of symbols each holding its name.
+    #[bench]
+    fn lookup_array(b: &mut Bencher) {
+        struct Symbol {
+            addr: u64,
+            size: u64,
+            name: String,
+        }
+        let syms = symbols();
+        let addrs = addresses(&syms);
+        let syms: Vec<_> = syms
+            .into_iter()
+            .map(|(addr, size, name)| Symbol { addr, size, name })
+            .collect();
+        b.iter(|| {
+            for addr in &addrs {
+                let sym = syms
+                    .binary_search_by(|sym| {
+                        if *addr < sym.addr {
+                            Ordering::Greater
+                        } else if *addr >= sym.addr + sym.size {
+                            Ordering::Less
+                        } else {
+                            Ordering::Equal
+                        }
+                    })
+                    .ok()
+                    .map(|i| syms[i].name.as_str());
+                black_box(sym);
+            }
+        });
+    }
+}
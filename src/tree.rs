@@ -0,0 +1,170 @@
+//! Storage of folded stacks as a call tree.
+//!
+//! Stacks share long common prefixes (for example, everything under the syscall entry point).
+//! Instead of storing each distinct stack in full, stacks are stored as paths in a tree of
+//! interned frames, with the number of occurrences of each stack on the node it ends at.
+
+use std::collections::HashMap;
+use std::io;
+use std::io::Write;
+
+/// The index of the root node.
+pub const ROOT: u32 = 0;
+/// Marks the absence of a node.
+const NONE: u32 = u32::MAX;
+
+/// Interned names of frames, shared by call trees.
+#[derive(Default)]
+pub struct FrameNames<'s> {
+    /// The name of each frame, by ID.
+    names: Vec<&'s str>,
+    /// The ID of each name.
+    ids: HashMap<&'s str, u32>,
+}
+
+impl<'s> FrameNames<'s> {
+    /// Returns the ID of the given name, allocating one if necessary.
+    pub fn intern(&mut self, name: &'s str) -> u32 {
+        *self.ids.entry(name).or_insert_with(|| {
+            self.names.push(name);
+            (self.names.len() - 1) as u32
+        })
+    }
+
+    /// Returns the name with the given ID.
+    pub fn get(&self, id: u32) -> &'s str {
+        self.names[id as usize]
+    }
+}
+
+/// A node of a call tree.
+struct Node {
+    /// The ID of the frame.
+    frame: u32,
+    /// The number of occurrences of the stack ending at this node.
+    count: u64,
+    /// The first child of the node.
+    first_child: u32,
+    /// The next child of the node's parent.
+    next_sibling: u32,
+}
+
+/// A set of stacks with the associated number of occurrences for each, stored as a tree.
+pub struct CallTree {
+    /// The nodes. The first one is the root, which does not correspond to any frame.
+    nodes: Vec<Node>,
+    /// The child of each node for a given frame, by `(parent, frame)`.
+    children: HashMap<(u32, u32), u32>,
+}
+
+impl Default for CallTree {
+    fn default() -> Self {
+        Self {
+            nodes: vec![Node {
+                frame: NONE,
+                count: 0,
+                first_child: NONE,
+                next_sibling: NONE,
+            }],
+            children: HashMap::new(),
+        }
+    }
+}
+
+impl CallTree {
+    /// Adds `count` occurrences of the stack made of `frames`, from the outermost to the innermost.
+    pub fn add<I: IntoIterator<Item = u32>>(&mut self, frames: I, count: u64) {
+        let mut node = ROOT;
+        for frame in frames {
+            node = *self.children.entry((node, frame)).or_insert_with(|| {
+                let child = self.nodes.len() as u32;
+                let parent = &mut self.nodes[node as usize];
+                let next_sibling = parent.first_child;
+                parent.first_child = child;
+                self.nodes.push(Node {
+                    frame,
+                    count: 0,
+                    first_child: NONE,
+                    next_sibling,
+                });
+                child
+            });
+        }
+        if node != ROOT {
+            self.nodes[node as usize].count += count;
+        }
+    }
+
+    /// Returns the ID of the frame of the given node. The root does not have any.
+    pub fn frame(&self, node: u32) -> u32 {
+        self.nodes[node as usize].frame
+    }
+
+    /// Returns the child of the given node for the given frame, if any.
+    pub fn child(&self, node: u32, frame: u32) -> Option<u32> {
+        self.children.get(&(node, frame)).copied()
+    }
+
+    /// Returns an iterator over the children of the given node.
+    pub fn children(&self, node: u32) -> impl Iterator<Item = u32> + '_ {
+        let mut child = self.nodes[node as usize].first_child;
+        std::iter::from_fn(move || {
+            let c = child;
+            child = self.nodes.get(c as usize)?.next_sibling;
+            Some(c)
+        })
+    }
+
+    /// Returns, for each node, the total number of occurrences of the stacks going through it,
+    /// which includes the stacks ending at the node and those ending at its descendants.
+    pub fn totals(&self) -> Vec<u64> {
+        let mut totals: Vec<u64> = self.nodes.iter().map(|n| n.count).collect();
+        // Children are always created after their parent, which makes a reverse traversal visit
+        // them first
+        for node in (0..self.nodes.len() as u32).rev() {
+            let sum: u64 = self.children(node).map(|c| totals[c as usize]).sum();
+            totals[node as usize] += sum;
+        }
+        totals
+    }
+
+    /// Calls `f` for each stack with its number of occurrences, in depth-first order. Frames are
+    /// given from the outermost to the innermost.
+    pub fn for_each_stack<F: FnMut(&[u32], u64) -> io::Result<()>>(
+        &self,
+        mut f: F,
+    ) -> io::Result<()> {
+        let mut path = Vec::new();
+        // The next node to visit at each depth
+        let mut next = vec![self.nodes[ROOT as usize].first_child];
+        while let Some(node) = next.last_mut() {
+            if *node == NONE {
+                next.pop();
+                path.pop();
+                continue;
+            }
+            let n = &self.nodes[*node as usize];
+            *node = n.next_sibling;
+            path.push(n.frame);
+            if n.count > 0 {
+                f(&path, n.count)?;
+            }
+            next.push(n.first_child);
+        }
+        Ok(())
+    }
+
+    /// Writes the stacks in the folded format accepted by `flamegraph.pl`: one line per stack,
+    /// with frames separated by `;`, followed by the number of occurrences.
+    pub fn write_folded<W: Write>(&self, names: &FrameNames, out: &mut W) -> io::Result<()> {
+        self.for_each_stack(|frames, count| {
+            for (i, frame) in frames.iter().enumerate() {
+                if i > 0 {
+                    out.write_all(b";")?;
+                }
+                out.write_all(names.get(*frame).as_bytes())?;
+            }
+            writeln!(out, " {count}")
+        })
+    }
+}
@@ -0,0 +1,214 @@
+//! Generation of unwind tables for the QEMU plugin.
+//!
+//! Kernels built without frame pointers cannot be unwound by following the chain of saved frame
+//! pointers. Instead, the plugin uses a table computed from the call frame information of the ELF
+//! (`.eh_frame` or `.debug_frame`), which gives, for each range of addresses, how to find the
+//! canonical frame address (CFA) and the saved frame pointer.
+//!
+//! The layout of the table is described in `plugin/unwind.h`.
+
+use anyhow::{anyhow, bail, Result};
+use elf::endian::AnyEndian;
+use elf::file::Class;
+use elf::ElfBytes;
+use gimli::{
+    BaseAddresses, CfaRule, CieOrFde, DebugFrame, EhFrame, LittleEndian, Reader, Register,
+    RegisterRule, UnwindContext, UnwindSection,
+};
+use std::io::Write;
+
+/// The magic number at the beginning of unwind tables.
+const MAGIC: [u8; 4] = *b"\x7fKPU";
+/// The version of the unwind table format.
+const VERSION: u16 = 1;
+
+/// The CFA is unknown: unwinding stops there.
+const CFA_UNDEFINED: u8 = 0;
+/// The CFA is relative to the stack pointer.
+const CFA_SP: u8 = 1;
+/// The CFA is relative to the frame pointer.
+const CFA_BP: u8 = 2;
+
+/// The frame pointer of the caller is the same as the one of the callee.
+const BP_SAME: u8 = 0;
+/// The frame pointer of the caller is saved at an offset from the CFA.
+const BP_AT_CFA: u8 = 1;
+
+/// The registers involved in unwinding, for a given architecture.
+struct Registers {
+    /// The size of a pointer in bytes.
+    ptr_width: u8,
+    /// The stack pointer.
+    sp: Register,
+    /// The frame pointer.
+    bp: Register,
+    /// The return address.
+    ra: Register,
+}
+
+/// How to unwind a frame at a given address.
+#[derive(Clone, Copy, Eq, PartialEq)]
+struct Rule {
+    /// The register the CFA is relative to (see `CFA_*`).
+    cfa_reg: u8,
+    /// The offset of the CFA from the register.
+    cfa_off: i32,
+    /// The location of the caller's frame pointer (see `BP_*`).
+    bp_rule: u8,
+    /// The offset of the caller's frame pointer from the CFA.
+    bp_off: i16,
+}
+
+impl Rule {
+    /// The rule for addresses without call frame information.
+    const UNDEFINED: Self = Self {
+        cfa_reg: CFA_UNDEFINED,
+        cfa_off: 0,
+        bp_rule: BP_SAME,
+        bp_off: 0,
+    };
+}
+
+/// Converts a row of the unwind table computed by `gimli` into a [`Rule`].
+///
+/// Rules that the plugin cannot follow are turned into [`Rule::UNDEFINED`].
+fn convert_row<R: Reader>(row: &gimli::UnwindTableRow<R::Offset>, regs: &Registers) -> Rule {
+    let (cfa_reg, cfa_off) = match row.cfa() {
+        CfaRule::RegisterAndOffset { register, offset } if *register == regs.sp => (CFA_SP, *offset),
+        CfaRule::RegisterAndOffset { register, offset } if *register == regs.bp => (CFA_BP, *offset),
+        _ => return Rule::UNDEFINED,
+    };
+    let Ok(cfa_off) = cfa_off.try_into() else {
+        return Rule::UNDEFINED;
+    };
+    // On x86, the return address is always right below the CFA
+    match row.register(regs.ra) {
+        RegisterRule::Offset(off) if off == -(regs.ptr_width as i64) => {}
+        _ => return Rule::UNDEFINED,
+    }
+    let (bp_rule, bp_off) = match row.register(regs.bp) {
+        RegisterRule::Offset(off) => match off.try_into() {
+            Ok(off) => (BP_AT_CFA, off),
+            Err(_) => return Rule::UNDEFINED,
+        },
+        _ => (BP_SAME, 0),
+    };
+    Rule {
+        cfa_reg,
+        cfa_off,
+        bp_rule,
+        bp_off,
+    }
+}
+
+/// Collects the rows of all the FDEs of the given section, as `(start, end, rule)`.
+fn collect_rows<R: Reader, S: UnwindSection<R>>(
+    section: &S,
+    bases: &BaseAddresses,
+    regs: &Registers,
+    rows: &mut Vec<(u64, u64, Rule)>,
+) -> Result<()> {
+    let mut ctx = Box::new(UnwindContext::new());
+    let mut entries = section.entries(bases);
+    while let Some(entry) = entries.next()? {
+        let CieOrFde::Fde(fde) = entry else {
+            continue;
+        };
+        let fde = fde.parse(|section, bases, off| section.cie_from_offset(bases, off))?;
+        let mut table = fde.rows(section, bases, &mut ctx)?;
+        while let Some(row) = table.next_row()? {
+            rows.push((
+                row.start_address(),
+                row.end_address(),
+                convert_row::<R>(row, regs),
+            ));
+        }
+    }
+    Ok(())
+}
+
+/// Computes the unwind table of the given ELF and writes it to `out`.
+///
+/// The function returns the number of entries in the table.
+pub fn write_table<W: Write>(elf: &ElfBytes<AnyEndian>, out: &mut W) -> Result<usize> {
+    let regs = match elf.ehdr.class {
+        Class::ELF64 => Registers {
+            ptr_width: 8,
+            sp: gimli::X86_64::RSP,
+            bp: gimli::X86_64::RBP,
+            ra: gimli::X86_64::RA,
+        },
+        Class::ELF32 => Registers {
+            ptr_width: 4,
+            sp: gimli::X86::ESP,
+            bp: gimli::X86::EBP,
+            ra: gimli::X86::RA,
+        },
+    };
+
+    // Collect rows. `.eh_frame` is preferred since it covers the whole kernel when present
+    let mut rows = Vec::new();
+    let text = elf.section_header_by_name(".text")?;
+    let mut bases = BaseAddresses::default();
+    if let Some(text) = &text {
+        bases = bases.set_text(text.sh_addr);
+    }
+    if let Some(shdr) = elf.section_header_by_name(".eh_frame")? {
+        let (data, _) = elf.section_data(&shdr)?;
+        let bases = bases.set_eh_frame(shdr.sh_addr);
+        let mut section = EhFrame::new(data, LittleEndian);
+        section.set_address_size(regs.ptr_width);
+        collect_rows(&section, &bases, &regs, &mut rows)?;
+    } else if let Some(shdr) = elf.section_header_by_name(".debug_frame")? {
+        let (data, _) = elf.section_data(&shdr)?;
+        let mut section = DebugFrame::new(data, LittleEndian);
+        section.set_address_size(regs.ptr_width);
+        collect_rows(&section, &bases, &regs, &mut rows)?;
+    } else {
+        bail!("ELF does not have call frame information (`.eh_frame` or `.debug_frame`)");
+    }
+    rows.retain(|(start, end, _)| start < end);
+    rows.sort_unstable_by_key(|(start, _, _)| *start);
+    let Some(base) = rows.first().map(|(start, _, _)| *start) else {
+        bail!("ELF does not have any unwind information");
+    };
+
+    // Build entries, each covering up to the start of the next one. Gaps between FDEs are
+    // covered by undefined entries, and identical consecutive entries are merged
+    let mut entries: Vec<(u32, Rule)> = Vec::with_capacity(rows.len());
+    let mut prev_end = base;
+    for (start, end, rule) in rows {
+        // Overlapping FDEs are ignored
+        if start < prev_end {
+            continue;
+        }
+        if start > prev_end {
+            entries.push(((prev_end - base) as u32, Rule::UNDEFINED));
+        }
+        let off = start - base;
+        let off: u32 = off
+            .try_into()
+            .map_err(|_| anyhow!("code spans more than 4 GiB"))?;
+        if entries.last().map(|(_, r)| *r) != Some(rule) {
+            entries.push((off, rule));
+        }
+        prev_end = end;
+    }
+    entries.push(((prev_end - base) as u32, Rule::UNDEFINED));
+
+    // Write table
+    out.write_all(&MAGIC)?;
+    out.write_all(&VERSION.to_le_bytes())?;
+    out.write_all(&[regs.ptr_width, 0])?;
+    out.write_all(&(entries.len() as u32).to_le_bytes())?;
+    out.write_all(&[0; 4])?;
+    out.write_all(&base.to_le_bytes())?;
+    for (off, rule) in &entries {
+        out.write_all(&off.to_le_bytes())?;
+        out.write_all(&rule.cfa_off.to_le_bytes())?;
+        out.write_all(&rule.bp_off.to_le_bytes())?;
+        out.write_all(&[rule.cfa_reg, rule.bp_rule])?;
+    }
+    out.flush()?;
+    Ok(entries.len())
+}